@@ -64,9 +64,13 @@ void ranges(
         out << ")";
 }
 
+/* If sentinel is set, the generated lexer expects the input to end with a '\0'
+ * that is not part of it, and only checks for the end of the input on
+ * transitions on '\0'. */
 int alumina_codegen(
     std::basic_ostream<char>& out,
-    const supercomplex::lexer<char, t_info>& automaton
+    const supercomplex::lexer<char, t_info>& automaton,
+    bool sentinel
 ) {
     constexpr std::string_view token_type_class = "TokenType";
     constexpr std::string_view token_class = "Token";
@@ -174,6 +178,7 @@ int alumina_codegen(
     out << "    value: &[u8]," << std::endl;
     out << "    start: usize," << std::endl;
     out << "    end: usize," << std::endl;
+    out << "    len: usize," << std::endl;
     out << "}" << std::endl << std::endl;
 
     out << "impl " << iterator_class << " {" << std::endl;
@@ -183,6 +188,10 @@ int alumina_codegen(
     out << "            value: value," << std::endl;
     out << "            start: 0," << std::endl;
     out << "            end: 0," << std::endl;
+    if (sentinel)
+        out << "            len: value.len() - 1," << std::endl;
+    else
+        out << "            len: value.len()," << std::endl;
     out << "        }" << std::endl;
     out << "    }" << std::endl << std::endl;
 
@@ -198,7 +207,7 @@ int alumina_codegen(
     out << "        }" << std::endl << std::endl;
 
     out << "        macro has_next() {" << std::endl;
-    out << "            self.end < self.value.len()" << std::endl;
+    out << "            self.end < self.len" << std::endl;
     out << "        }" << std::endl << std::endl;
 
     out << "        macro bail($error_type) {" << std::endl;
@@ -222,13 +231,13 @@ int alumina_codegen(
         bool first = true;
         for (auto&& transition : state.transitions) {
             if (first) {
-                out << "                    if has_next!() &&" << std::endl;
-                out << "                        ";
+                out << "                    if ";
                 first = false;
             } else {
-                out << "                    else if has_next!() &&" << std::endl;
-                out << "                        ";
+                out << "                    else if ";
             }
+            if (!sentinel || boost::icl::contains(transition.characters, '\0'))
+                out << "has_next!() &&" << std::endl << "                        ";
             ranges(out, "ch!()", transition.characters);
             out << " {" << std::endl;
             if (i != transition.next) {
@@ -289,7 +298,9 @@ int alumina_codegen(
     out << "mod tests {" << std::endl;
     out << "    #[test]" << std::endl;
     out << "    fn test_basic() {" << std::endl;
-    out << "        let it = " << iterator_class << "::new(\"\");" << std::endl << std::endl;
+    out << "        let it = " << iterator_class << "::new(\"" << (sentinel ? "\\0" : "") << "\");"
+        << std::endl
+        << std::endl;
     out << "        assert!(it.next().is_none());" << std::endl;
     out << "    }" << std::endl;
     out << "}" << std::endl;
@@ -305,9 +316,10 @@ lexer_production<char, t_info> skip(const std::string& regex) {
     return { { std::string(), true }, regex };
 }
 
-int main() {
+int main(int argc, char** argv) {
     /*
-      This will generate Alumina code for a JSON lexer.
+      This will generate Alumina code for a JSON lexer. With --sentinel, the
+      lexer scans input terminated by a '\0' without bounds checks.
     */
     lexer_generator<char, t_info> lex_gen;
     lex_gen
@@ -316,11 +328,11 @@ int main() {
         << prod("Colon", ":")
         << prod(
                "String",
-               "\"(\\\\([\"\\\\/bfrnt]|u[0-9a-fA-F][0-9a-fA-F][0-9a-fA-F][0-9a-fA-F])|[^\"\\\\\0-\x1f])*\""s
+               "\"(\\\\([\"\\\\/bfrnt]|u[0-9a-fA-F]{4})|[^\"\\\\\0-\x1f])*\""s
            )
         << prod("Number", "-?(0|[1-9][0-9]*)(.[0-9]+)?([Ee][+\\-]?(0|[1-9][0-9]*))?")
         << skip("[ \t\n\r]+");
 
     auto lexer = lex_gen.generate();
-    alumina_codegen(std::cout, lexer);
+    alumina_codegen(std::cout, lexer, argc > 1 && argv[1] == "--sentinel"s);
 }
@@ -1,5 +1,7 @@
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <ostream>
 #include <string>
 
@@ -11,6 +13,7 @@ using namespace supercomplex;
 struct t_info {
     std::string name;
     bool skip;
+    bool hashed;
 };
 
 /* Represent character as a C++ character literal to make the output a bit more
@@ -40,6 +43,25 @@ std::string represent_char(char ch) {
     return stream.str();
 }
 
+/* Represent string as a C++ string literal */
+std::string represent_string(const std::string& value) {
+    std::stringstream stream;
+    stream << "\"";
+
+    for (char ch : value) {
+        if (ch == '\\' || ch == '"')
+            stream << "\\" << ch;
+        else if ((ch >= ' ') && (ch < '\x7f'))
+            stream << ch;
+        else
+            stream << "\\" << std::oct << std::setfill('0') << std::setw(3)
+                   << (static_cast<int>(ch) & 0xFF) << std::dec;
+    }
+
+    stream << "\"";
+    return stream.str();
+}
+
 /* Represent interval set as a bool condition that can be used in IF clause */
 void ranges(
     std::basic_ostream<char>& out,
@@ -65,6 +87,8 @@ void ranges(
 }
 
 int cpp_codegen(std::basic_ostream<char>& out, const supercomplex::lexer<char, t_info>& automaton) {
+    out << "#include <algorithm>" << std::endl;
+    out << "#include <cstdint>" << std::endl;
     out << "#include <iostream>" << std::endl;
     out << "#include <sstream>" << std::endl;
     out << "#include <exception>" << std::endl;
@@ -88,25 +112,40 @@ int cpp_codegen(std::basic_ostream<char>& out, const supercomplex::lexer<char, t
         }
     }
 
+    /* Keywords reclassified after the fact are not part of any state. */
+    const auto& keywords = automaton.keywords();
+    for (auto&& keyword : keywords.infos) {
+        if (visited_terminals.find(keyword.name) == visited_terminals.end()) {
+            out << "    " << keyword.name << " = " << (index++) << "," << std::endl;
+            visited_terminals.insert(keyword.name);
+        }
+    }
+
     out << "};" << std::endl << std::endl;
 
     out << "struct " << token_class << " {" << std::endl;
     out << "    " << token_type_class << " type;" << std::endl;
     out << "    std::string value;" << std::endl;
+    out << "    size_t line;" << std::endl;
+    out << "    size_t column;" << std::endl;
+    out << "    uint64_t hash;" << std::endl;
     out << "};" << std::endl << std::endl;
 
-    out << "template<typename input_iterator_t>" << std::endl;
+    /* With terminated = true, the input has to be followed by a '\0' that is
+     * not part of it, and the end is only checked on transitions on '\0'. */
+    out << "template<typename input_iterator_t, bool terminated = false>" << std::endl;
     out << "struct " << iterator_class << " " << std::endl;
     out << "{" << std::endl;
     out << "public:" << std::endl;
-    out << "    typedef lexer_iterator<input_iterator_t> self_type;" << std::endl;
+    out << "    typedef lexer_iterator<input_iterator_t, terminated> self_type;" << std::endl;
     out << "    typedef " << token_class << " value_type;" << std::endl;
     out << "    typedef " << token_class << "& reference;" << std::endl;
     out << "    typedef " << token_class << "* pointer;" << std::endl;
     out << "    typedef std::forward_iterator_tag iterator_category;" << std::endl << std::endl;
 
     out << "    " << iterator_class << "(input_iterator_t begin, input_iterator_t end) : state_("
-        << automaton.start() << "), position_(begin), end_(end) { next(); };" << std::endl;
+        << automaton.start()
+        << "), position_(begin), end_(end), line_(1), column_(1) { next(); };" << std::endl;
     out << "    " << iterator_class << "() : state_(-1) {};" << std::endl;
     out << "    const reference operator*() { return value_; }" << std::endl;
     out << "    const pointer operator->() { return &value_; } " << std::endl;
@@ -120,9 +159,75 @@ int cpp_codegen(std::basic_ostream<char>& out, const supercomplex::lexer<char, t
     out << "    self_type operator++() { self_type i = *this; next(); return i; }" << std::endl;
     out << "    self_type operator++(int junk) { next(); return *this; }" << std::endl << std::endl;
 
+    if (!keywords.empty()) {
+        /* Perfect hash lookup equivalent to keyword_table::find() */
+        out << "    static uint32_t hash(uint32_t seed, const std::string& value)" << std::endl;
+        out << "    {" << std::endl;
+        out << "        uint32_t hash = 2166136261u ^ seed;" << std::endl;
+        out << "        for (char ch : value)" << std::endl;
+        out << "            hash = (hash ^ static_cast<uint32_t>(ch)) * 16777619u;" << std::endl;
+        out << "        hash ^= hash >> 16;" << std::endl;
+        out << "        hash *= 0x85ebca6bu;" << std::endl;
+        out << "        hash ^= hash >> 13;" << std::endl;
+        out << "        hash *= 0xc2b2ae35u;" << std::endl;
+        out << "        hash ^= hash >> 16;" << std::endl;
+        out << "        return hash;" << std::endl;
+        out << "    }" << std::endl << std::endl;
+
+        out << "    static bool keyword(const std::string& value, " << token_type_class
+            << "& type)" << std::endl;
+        out << "    {" << std::endl;
+        out << "        static const uint32_t seeds[] = {";
+        for (auto&& seed : keywords.seeds)
+            out << " " << seed << ",";
+        out << " };" << std::endl;
+        out << "        static const int slots[] = {";
+        for (auto&& slot : keywords.slots)
+            out << " " << slot << ",";
+        out << " };" << std::endl;
+        out << "        static const char* const words[] = {";
+        for (auto&& word : keywords.words)
+            out << " " << represent_string(word) << ",";
+        out << " };" << std::endl;
+        out << "        static const " << token_type_class << " types[] = {";
+        for (auto&& keyword : keywords.infos)
+            out << " " << token_type_class << "::" << keyword.name << ",";
+        out << " };" << std::endl;
+        out << "        int index = slots[hash(seeds[hash(0, value) % " << keywords.seeds.size()
+            << "], value) % " << keywords.slots.size() << "];" << std::endl;
+        out << "        if (index == -1 || value != words[index])" << std::endl;
+        out << "            return false;" << std::endl;
+        out << "        type = types[index];" << std::endl;
+        out << "        return true;" << std::endl;
+        out << "    }" << std::endl << std::endl;
+    }
+
+    /* Kept out of line so that the error path does not bloat the hot loop. */
+    out << "#if defined(__GNUC__)" << std::endl;
+    out << "    __attribute__((cold, noinline))" << std::endl;
+    out << "#endif" << std::endl;
+    out << "    static void invalid_input()" << std::endl;
+    out << "    {" << std::endl;
+    out << "        throw std::runtime_error(\"Invalid input\");" << std::endl;
+    out << "    }" << std::endl << std::endl;
+
+    /* The location is tracked per token rather than per character, by
+     * counting the newlines in the token's value. */
+    out << "    void advance(const std::string& value)" << std::endl;
+    out << "    {" << std::endl;
+    out << "        auto lines = std::count(value.begin(), value.end(), '\\n');" << std::endl;
+    out << "        if (lines == 0) {" << std::endl;
+    out << "            column_ += value.size();" << std::endl;
+    out << "            return;" << std::endl;
+    out << "        }" << std::endl;
+    out << "        line_ += lines;" << std::endl;
+    out << "        column_ = value.size() - value.rfind('\\n');" << std::endl;
+    out << "    }" << std::endl << std::endl;
+
     out << "    void next()" << std::endl;
     out << "    {" << std::endl;
     out << "        std::stringstream buffer;" << std::endl;
+    out << "        uint64_t token_hash = 14695981039346656037ull;" << std::endl;
 
     out << "        for (;;) " << std::endl;
     out << "        {" << std::endl;
@@ -133,6 +238,23 @@ int cpp_codegen(std::basic_ostream<char>& out, const supercomplex::lexer<char, t
 
     const auto& states = automaton.states();
 
+    /* Tokens of hashed productions get the same FNV-1a hash as token_hash(),
+     * computed while scanning. Only transitions into states from which such a
+     * token can still be accepted update it. */
+    std::vector<bool> hashing(states.size(), false);
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = 0; i < states.size(); ++i) {
+            bool reaches = states[i].terminal && states[i].terminal_info.hashed;
+            for (auto&& transition : states[i].transitions)
+                reaches = reaches || hashing[transition.next];
+            if (reaches && !hashing[i]) {
+                hashing[i] = true;
+                changed = true;
+            }
+        }
+    }
+
     for (size_t i = 0; i < states.size(); ++i) {
         const auto& state = states[i];
 
@@ -140,12 +262,23 @@ int cpp_codegen(std::basic_ostream<char>& out, const supercomplex::lexer<char, t
         bool first = true;
         for (auto&& transition : state.transitions) {
             if (first)
-                out << "                    if ((position_ != end_) && ";
+                out << "                    if (";
             else
-                out << "                    else if ((position_ != end_) && ";
+                out << "                    else if (";
+            if (boost::icl::contains(transition.characters, '\0'))
+                out << "(position_ != end_) && ";
+            else
+                out << "(terminated || position_ != end_) && ";
             ranges(out, "*position_", transition.characters);
-            out << ")" << std::endl
-                << "                        state_ = " << transition.next << ";" << std::endl;
+            out << ")" << std::endl;
+            if (hashing[transition.next]) {
+                out << "                        state_ = " << transition.next
+                    << ", token_hash = (token_hash ^ static_cast<unsigned char>(*position_)) "
+                       "* 1099511628211ull;"
+                    << std::endl;
+            } else {
+                out << "                        state_ = " << transition.next << ";" << std::endl;
+            }
             first = false;
         }
         if (!first)
@@ -156,16 +289,23 @@ int cpp_codegen(std::basic_ostream<char>& out, const supercomplex::lexer<char, t
             out << "                        state_ = " << automaton.start() << ";" << std::endl;
             if (!terminal_node.skip) {
                 out << "                        value_ = value_type { " << token_type_class
-                    << "::" << terminal_node.name << ", buffer.str() };" << std::endl;
+                    << "::" << terminal_node.name << ", buffer.str(), line_, column_, "
+                    << (terminal_node.hashed ? "token_hash" : "0") << " };" << std::endl;
+                out << "                        advance(value_.value);" << std::endl;
+                if (state.keywords)
+                    out << "                        keyword(value_.value, value_.type);"
+                        << std::endl;
                 out << "                        return;" << std::endl;
             } else {
+                out << "                        advance(buffer.str());" << std::endl;
                 out << "                        buffer = std::stringstream();" << std::endl;
+                if (hashing[automaton.start()])
+                    out << "                        token_hash = 14695981039346656037ull;"
+                        << std::endl;
                 out << "                        continue;" << std::endl;
             }
         } else {
-            out << "                        throw std::runtime_error(\"Invalid "
-                   "input\");"
-                << std::endl;
+            out << "                        invalid_input();" << std::endl;
         }
         if (!first)
             out << "                    }" << std::endl;
@@ -174,7 +314,7 @@ int cpp_codegen(std::basic_ostream<char>& out, const supercomplex::lexer<char, t
     }
 
     out << "            }" << std::endl;
-    out << "            if (position_ != end_)" << std::endl;
+    out << "            if (terminated || position_ != end_)" << std::endl;
     out << "                buffer << *position_++;" << std::endl;
     out << "            else" << std::endl;
     out << "                break;" << std::endl;
@@ -188,6 +328,8 @@ int cpp_codegen(std::basic_ostream<char>& out, const supercomplex::lexer<char, t
     out << "    input_iterator_t position_;" << std::endl;
     out << "    input_iterator_t end_;" << std::endl;
     out << "    int state_;" << std::endl;
+    out << "    size_t line_;" << std::endl;
+    out << "    size_t column_;" << std::endl;
     out << "};" << std::endl << std::endl;
 
     /*
@@ -205,17 +347,20 @@ int cpp_codegen(std::basic_ostream<char>& out, const supercomplex::lexer<char, t
     return 0;
 }
 
-lexer_production<char, t_info> prod(const std::string& name, const std::string& regex) {
-    return { { name, false }, regex };
+lexer_production<char, t_info>
+prod(const std::string& name, const std::string& regex, bool hashed = false) {
+    return { { name, false, hashed }, regex };
 }
 
 lexer_production<char, t_info> skip(const std::string& regex) {
-    return { { std::string(), true }, regex };
+    return { { std::string(), true, false }, regex };
 }
 
-int main() {
+int main(int argc, char** argv) {
     /*
-      This will generate C++ code for a JSON lexer.
+      This will generate C++ code for a JSON lexer. If a sample JSON file is
+      given, the lexer is profiled on it and the states and transitions are
+      laid out by how often they are used.
     */
     lexer_generator<char, t_info> lex_gen;
     lex_gen
@@ -224,11 +369,24 @@ int main() {
         << prod("COLON", ":")
         << prod(
                "STRING",
-               "\"(\\\\([\"\\\\/bfrnt]|u[0-9a-fA-F][0-9a-fA-F][0-9a-fA-F][0-9a-fA-F])|[^\"\\\\\0-\x1f])*\""s
+               "\"(\\\\([\"\\\\/bfrnt]|u[0-9a-fA-F]{4})|[^\"\\\\\0-\x1f])*\""s,
+               true
            )
         << prod("NUMBER", "-?(0|[1-9][0-9]*)(.[0-9]+)?([Ee][+\\-]?(0|[1-9][0-9]*))?")
         << skip("[ \t\n\r]+");
 
     auto lexer = lex_gen.generate();
+
+    if (argc > 1) {
+        std::ifstream sample(argv[1], std::ios::binary);
+        std::string corpus(
+            (std::istreambuf_iterator<char>(sample)), std::istreambuf_iterator<char>()
+        );
+
+        lexer_profile profile;
+        lexer.profile(corpus.begin(), corpus.end(), profile);
+        lexer = lex_gen.generate(profile);
+    }
+
     cpp_codegen(std::cout, lexer);
 }
@@ -111,7 +111,7 @@ int main() {
         << prod("COLON", ":")
         << prod(
                "STRING",
-               "\"(\\\\([\"\\\\/bfrnt]|u[0-9a-fA-F][0-9a-fA-F][0-9a-fA-F][0-9a-fA-F])|[^\"\\\\\0-\x1f])*\""s
+               "\"(\\\\([\"\\\\/bfrnt]|u[0-9a-fA-F]{4})|[^\"\\\\\0-\x1f])*\""s
            )
         << prod("NUMBER", "-?(0|[1-9][0-9]*)(.[0-9]+)?([Ee][+\\-]?(0|[1-9][0-9]*))?")
         << skip("[ \t\n\r]+");
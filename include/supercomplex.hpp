@@ -1,7 +1,19 @@
 #pragma once
 
+#include <algorithm>
+#include <bitset>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <iterator>
+#include <limits>
+#include <map>
 #include <memory>
+#include <ostream>
 #include <queue>
+#include <set>
+#include <stdexcept>
+#include <string>
 #include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
@@ -10,8 +22,258 @@
 
 #include <boost/icl/interval_set.hpp>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace supercomplex {
 
+    /**
+     * Set of characters stored as a sorted array of disjoint closed intervals,
+     * with adjacent intervals merged, so equal sets have equal representations.
+     * Up to two intervals (which covers most character sets of a regex) are
+     * kept inline without allocating.
+     */
+    template <typename CharType>
+    class range_set {
+      public:
+        struct interval {
+            CharType lower;
+            CharType upper;
+
+            size_t length() const {
+                return static_cast<size_t>(
+                           static_cast<int64_t>(upper) - static_cast<int64_t>(lower)
+                       ) +
+                       1;
+            }
+
+            bool operator==(const interval& other) const {
+                return lower == other.lower && upper == other.upper;
+            }
+        };
+
+      private:
+        static constexpr size_t inline_capacity = 2;
+
+        interval _inline[inline_capacity];
+        std::vector<interval> _heap;
+        size_t _size;
+
+        /* Whether x ends before ch and is not adjacent to it. */
+        static bool before(const interval& x, CharType ch) {
+            return x.upper < ch && static_cast<CharType>(x.upper + 1) != ch;
+        }
+
+        /* Whether x starts after ch and is not adjacent to it. */
+        static bool after(CharType ch, const interval& x) {
+            return ch < x.lower && static_cast<CharType>(ch + 1) != x.lower;
+        }
+
+        interval* data() {
+            return _size > inline_capacity ? _heap.data() : _inline;
+        }
+
+        void resize(size_t size) {
+            if (size > inline_capacity) {
+                if (_size <= inline_capacity)
+                    _heap.assign(_inline, _inline + _size);
+                _heap.resize(size);
+            } else if (_size > inline_capacity) {
+                std::copy(_heap.begin(), _heap.begin() + size, _inline);
+                _heap.clear();
+            }
+            _size = size;
+        }
+
+        /* Replaces the intervals [first, last) with count intervals from items. */
+        void splice(size_t first, size_t last, const interval* items, size_t count) {
+            size_t tail = _size - last;
+            size_t size = first + count + tail;
+            if (size > _size) {
+                resize(size);
+                std::copy_backward(data() + last, data() + last + tail, data() + size);
+            } else {
+                std::copy(data() + last, data() + last + tail, data() + first + count);
+                resize(size);
+            }
+            std::copy(items, items + count, data() + first);
+        }
+
+        /* Appends an interval starting at or after the lower bound of the last one. */
+        void append(const interval& x) {
+            if (_size != 0 && !after(back().upper, x)) {
+                back().upper = std::max(back().upper, x.upper);
+                return;
+            }
+            resize(_size + 1);
+            back() = x;
+        }
+
+        interval& back() {
+            return data()[_size - 1];
+        }
+
+        /* Index of the first interval that does not end before ch. */
+        size_t lower_index(CharType ch) const {
+            return std::partition_point(begin(), end(), [ch](const interval& x) {
+                       return before(x, ch);
+                   }) -
+                   begin();
+        }
+
+        /* Index of the first interval that starts after ch. */
+        size_t upper_index(CharType ch) const {
+            return std::partition_point(begin(), end(), [ch](const interval& x) {
+                       return !after(ch, x);
+                   }) -
+                   begin();
+        }
+
+      public:
+        range_set() : _inline(), _size(0) {
+        }
+
+        range_set(CharType lower, CharType upper) : _inline(), _size(0) {
+            add(lower, upper);
+        }
+
+        const interval* begin() const {
+            return _size > inline_capacity ? _heap.data() : _inline;
+        }
+
+        const interval* end() const {
+            return begin() + _size;
+        }
+
+        /**
+         * Number of intervals.
+         */
+        size_t size() const {
+            return _size;
+        }
+
+        bool empty() const {
+            return _size == 0;
+        }
+
+        void add(CharType lower, CharType upper) {
+            if (upper < lower)
+                return;
+
+            auto first = lower_index(lower);
+            auto last = upper_index(upper);
+            interval merged{ lower, upper };
+            if (first != last) {
+                merged.lower = std::min(lower, begin()[first].lower);
+                merged.upper = std::max(upper, begin()[last - 1].upper);
+            }
+            splice(first, last, &merged, 1);
+        }
+
+        void add(CharType ch) {
+            add(ch, ch);
+        }
+
+        void subtract(CharType lower, CharType upper) {
+            if (upper < lower)
+                return;
+
+            // Adjacent intervals are not affected.
+            auto first = std::partition_point(begin(), end(), [lower](const interval& x) {
+                             return x.upper < lower;
+                         }) -
+                         begin();
+            auto last = std::partition_point(begin(), end(), [upper](const interval& x) {
+                            return !(upper < x.lower);
+                        }) -
+                        begin();
+            if (first == last)
+                return;
+
+            interval rest[2];
+            size_t count = 0;
+            if (begin()[first].lower < lower)
+                rest[count++] = { begin()[first].lower, static_cast<CharType>(lower - 1) };
+            if (upper < begin()[last - 1].upper)
+                rest[count++] = { static_cast<CharType>(upper + 1), begin()[last - 1].upper };
+            splice(first, last, rest, count);
+        }
+
+        void subtract(CharType ch) {
+            subtract(ch, ch);
+        }
+
+        range_set& operator+=(const range_set& other) {
+            range_set result;
+            auto a = begin(), b = other.begin();
+            while (a != end() || b != other.end()) {
+                if (b == other.end() || (a != end() && a->lower < b->lower))
+                    result.append(*a++);
+                else
+                    result.append(*b++);
+            }
+            return *this = std::move(result);
+        }
+
+        range_set& operator&=(const range_set& other) {
+            range_set result;
+            auto a = begin(), b = other.begin();
+            while (a != end() && b != other.end()) {
+                auto lower = std::max(a->lower, b->lower);
+                auto upper = std::min(a->upper, b->upper);
+                if (!(upper < lower))
+                    result.append({ lower, upper });
+                if (a->upper < b->upper)
+                    ++a;
+                else
+                    ++b;
+            }
+            return *this = std::move(result);
+        }
+
+        bool contains(CharType ch) const {
+            // Small sets are scanned linearly, without data-dependent branches.
+            if (_size <= 8) {
+                bool found = false;
+                for (auto&& x : *this)
+                    found |= !(ch < x.lower) && !(x.upper < ch);
+                return found;
+            }
+            auto it = std::partition_point(begin(), end(), [ch](const interval& x) {
+                return x.upper < ch;
+            });
+            return it != end() && !(ch < it->lower);
+        }
+
+        bool contains(const interval& chars) const {
+            auto it = std::partition_point(begin(), end(), [&chars](const interval& x) {
+                return x.upper < chars.lower;
+            });
+            return it != end() && !(chars.lower < it->lower) && !(it->upper < chars.upper);
+        }
+
+        bool operator==(const range_set& other) const {
+            return _size == other._size && std::equal(begin(), end(), other.begin());
+        }
+
+        bool operator!=(const range_set& other) const {
+            return !(*this == other);
+        }
+    };
+
+    template <typename CharType>
+    struct range_set_hash {
+        size_t operator()(const range_set<CharType>& x) const {
+            size_t hash = 2166136261;
+            for (auto&& interval : x) {
+                hash = hash * 16777619 ^ static_cast<size_t>(interval.lower);
+                hash = hash * 16777619 ^ static_cast<size_t>(interval.upper);
+            }
+            return hash;
+        }
+    };
+
     template <typename CharType, typename TokenInfo>
     struct nfa_node;
 
@@ -19,17 +281,14 @@ namespace supercomplex {
     struct nfa_transition {
         bool epsilon;
 
-        boost::icl::interval_set<CharType> characters;
+        range_set<CharType> characters;
         nfa_node<CharType, TokenInfo>* next;
 
         explicit nfa_transition(nfa_node<CharType, TokenInfo>* next_) : epsilon(true), next(next_) {
         }
 
-        nfa_transition(
-            boost::icl::interval_set<CharType> characters_,
-            nfa_node<CharType, TokenInfo>* next_
-        )
-          : epsilon(false), characters(characters_), next(next_) {
+        nfa_transition(range_set<CharType> characters_, nfa_node<CharType, TokenInfo>* next_)
+          : epsilon(false), characters(std::move(characters_)), next(next_) {
         }
     };
 
@@ -58,890 +317,4490 @@ namespace supercomplex {
     struct terminal_node {
         TokenInfo token;
         std::basic_string<CharType> regex;
+        uint64_t modes;
 
-        terminal_node(const TokenInfo& token, const std::string& regex)
-          : token(token), regex(regex) {
+        terminal_node(
+            const TokenInfo& token,
+            const std::basic_string<CharType>& regex,
+            uint64_t modes = 1
+        )
+          : token(token), regex(regex), modes(modes) {
         }
     };
 
     template <typename CharType, typename TokenInfo>
-    struct regex_node {
-        virtual ~regex_node() {
+    struct dictionary_node {
+        TokenInfo token;
+        std::vector<std::basic_string<CharType>> words;
+        uint64_t modes;
+
+        dictionary_node(
+            const TokenInfo& token,
+            const std::vector<std::basic_string<CharType>>& words,
+            uint64_t modes = 1
+        )
+          : token(token), words(words), modes(modes) {
         }
-        virtual nfa_segment<CharType, TokenInfo> nfa() = 0;
     };
 
     enum class operator_type { plus, star, optional };
 
-    template <typename CharType, typename TokenInfo>
-    struct character_set : regex_node<CharType, TokenInfo> {
-        boost::icl::interval_set<CharType> char_set;
-        character_set(){};
-        explicit character_set(CharType a) {
-            char_set.add(a);
-        };
+    enum class regex_kind : uint8_t { character_set, concatenate, alternative, quantifier };
 
-        nfa_segment<CharType, TokenInfo> nfa() override {
-            nfa_segment<CharType, TokenInfo> result(
-                new nfa_node<CharType, TokenInfo>(), new nfa_node<CharType, TokenInfo>()
-            );
-            result.begin->transitions.push_back(
-                nfa_transition<CharType, TokenInfo>(char_set, result.end)
-            );
-            return result;
-        }
-    };
+    using regex_id = uint32_t;
 
-    template <typename CharType, typename TokenInfo>
-    struct operand : regex_node<CharType, TokenInfo> {
-        std::shared_ptr<regex_node<CharType, TokenInfo>> child;
+    constexpr regex_id no_regex = std::numeric_limits<regex_id>::max();
+
+    /**
+     * A node of the regex syntax tree. Children of a node are stored contiguously
+     * in the arena, character sets are referred to by their index.
+     */
+    struct regex_expr {
+        regex_kind kind;
         operator_type oper;
-        operand(std::shared_ptr<regex_node<CharType, TokenInfo>> child_, operator_type oper_)
-          : child(child_), oper(oper_) {
-            if (child_.get() == nullptr) {
-                throw std::runtime_error("Cannot quantify an empty string.");
-            }
+        uint32_t first;
+        uint32_t count;
+    };
+
+    template <typename CharType>
+    class regex_arena;
+
+    template <typename CharType, typename T>
+    regex_id parse_regex(regex_arena<CharType>& arena, T& begin, T end);
+
+    /**
+     * Flat storage for the regex syntax trees of all the productions. Nodes are
+     * hash-consed, so identical subexpressions (within a single regex or across
+     * several of them) are represented by the same regex_id, and each distinct
+     * regex string is only parsed once.
+     */
+    template <typename CharType>
+    class regex_arena {
+        using set_type = range_set<CharType>;
+
+        std::vector<regex_expr> _nodes;
+        std::vector<regex_id> _children;
+        std::vector<regex_id> _buckets;
+        std::vector<set_type> _sets;
+        std::unordered_map<set_type, uint32_t, range_set_hash<CharType>> _set_index;
+        std::unordered_map<std::basic_string<CharType>, regex_id> _parsed;
+        std::vector<regex_id> _simplified;
+
+        size_t hash(regex_id id) const {
+            const auto& expr = _nodes[id];
+            size_t hash = 2166136261;
+            hash = hash * 16777619 ^ static_cast<size_t>(expr.kind);
+            hash = hash * 16777619 ^ static_cast<size_t>(expr.oper);
+            if (expr.kind == regex_kind::character_set)
+                return hash * 16777619 ^ expr.first;
+            for (auto it = begin(id); it != end(id); ++it)
+                hash = hash * 16777619 ^ *it;
+            return hash;
         }
 
-        nfa_segment<CharType, TokenInfo> nfa() override {
-            nfa_segment<CharType, TokenInfo> child_nfa = child->nfa();
-            nfa_segment<CharType, TokenInfo> result(
-                new nfa_node<CharType, TokenInfo>(), new nfa_node<CharType, TokenInfo>()
-            );
-            switch (oper) {
-                case operator_type::plus:
-                    child_nfa.end->transitions.push_back(
-                        nfa_transition<CharType, TokenInfo>(child_nfa.begin)
-                    );
-                    break;
-                case operator_type::star:
-                    result.begin->transitions.push_back(
-                        nfa_transition<CharType, TokenInfo>(result.end)
-                    );
-                    child_nfa.end->transitions.push_back(
-                        nfa_transition<CharType, TokenInfo>(child_nfa.begin)
-                    );
-                    break;
-                case operator_type::optional:
-                    result.begin->transitions.push_back(
-                        nfa_transition<CharType, TokenInfo>(result.end)
-                    );
-                    break;
-                default:
-                    break;
+        bool equal(regex_id x, regex_id y) const {
+            const auto& a = _nodes[x];
+            const auto& b = _nodes[y];
+            if (a.kind != b.kind || a.oper != b.oper || a.count != b.count)
+                return false;
+            if (a.kind == regex_kind::character_set)
+                return a.first == b.first;
+            return std::equal(begin(x), end(x), begin(y));
+        }
+
+        regex_id& bucket(regex_id id) {
+            size_t mask = _buckets.size() - 1;
+            for (size_t i = hash(id) & mask;; i = (i + 1) & mask) {
+                if (_buckets[i] == no_regex || equal(_buckets[i], id))
+                    return _buckets[i];
             }
-            result.begin->transitions.push_back(nfa_transition<CharType, TokenInfo>(child_nfa.begin)
-            );
-            child_nfa.end->transitions.push_back(nfa_transition<CharType, TokenInfo>(result.end));
-            return result;
         }
-    };
 
-    template <typename CharType, typename TokenInfo>
-    struct concatenate : regex_node<CharType, TokenInfo> {
-        std::vector<std::shared_ptr<regex_node<CharType, TokenInfo>>> terms;
+        void rehash() {
+            std::vector<regex_id> old(std::max<size_t>(16, _buckets.size() * 2), no_regex);
+            old.swap(_buckets);
+            for (auto&& id : old) {
+                if (id != no_regex)
+                    bucket(id) = id;
+            }
+        }
 
-        nfa_segment<CharType, TokenInfo> nfa() override {
-            nfa_node<CharType, TokenInfo>* first = new nfa_node<CharType, TokenInfo>();
-            nfa_node<CharType, TokenInfo>* last = first;
+        /* Returns the existing node equal to the one just pushed, or the new one. */
+        regex_id intern() {
+            if (_nodes.size() * 2 > _buckets.size())
+                rehash();
 
-            for (auto&& node : terms) {
-                nfa_segment<CharType, TokenInfo> child_nfa = node->nfa();
-                for (auto&& transition : child_nfa.begin->transitions) {
-                    last->transitions.push_back(transition);
-                }
-                last = child_nfa.end;
+            regex_id id = static_cast<regex_id>(_nodes.size() - 1);
+            auto& slot = bucket(id);
+            if (slot == no_regex) {
+                slot = id;
+                return id;
             }
 
-            return nfa_segment<CharType, TokenInfo>(first, last);
+            if (_nodes.back().kind != regex_kind::character_set)
+                _children.resize(_nodes.back().first);
+            _nodes.pop_back();
+            return slot;
         }
-    };
 
-    template <typename CharType, typename TokenInfo>
-    struct alternative : regex_node<CharType, TokenInfo> {
-        std::vector<std::shared_ptr<regex_node<CharType, TokenInfo>>> alternatives;
+        regex_id compound(regex_kind kind, operator_type oper, const std::vector<regex_id>& items) {
+            _nodes.push_back(regex_expr{ kind,
+                                         oper,
+                                         static_cast<uint32_t>(_children.size()),
+                                         static_cast<uint32_t>(items.size()) });
+            _children.insert(_children.end(), items.begin(), items.end());
+            return intern();
+        }
 
-        nfa_segment<CharType, TokenInfo> nfa() override {
-            nfa_segment<CharType, TokenInfo> result(
-                new nfa_node<CharType, TokenInfo>(), new nfa_node<CharType, TokenInfo>()
-            );
+        bool empty(regex_id id) const {
+            return _nodes[id].kind == regex_kind::concatenate && _nodes[id].count == 0;
+        }
 
-            for (auto&& node : alternatives) {
-                nfa_segment<CharType, TokenInfo> child_nfa = node->nfa();
-                result.begin->transitions.push_back(
-                    nfa_transition<CharType, TokenInfo>(child_nfa.begin)
-                );
-                child_nfa.end->transitions.push_back(nfa_transition<CharType, TokenInfo>(result.end)
-                );
-            }
+        /* Appends the terms of a concatenation, or the expression itself. */
+        void append_terms(std::vector<regex_id>& terms, regex_id id) const {
+            if (_nodes[id].kind == regex_kind::concatenate)
+                terms.insert(terms.end(), begin(id), end(id));
+            else
+                terms.push_back(id);
+        }
 
-            return result;
+        regex_id sequence(const std::vector<regex_id>& terms) {
+            return terms.size() == 1 ? terms.front() : concatenate(terms);
         }
-    };
 
-    template <typename CharType, typename TokenInfo, typename T>
-    std::shared_ptr<regex_node<CharType, TokenInfo>> parse_regex(T& begin, T end);
+        regex_id simplify_quantifier(regex_id child, operator_type oper) {
+            if (empty(child))
+                return child;
 
-    template <typename CharType>
-    void make_closed(boost::icl::interval_set<CharType>& intervals) {
-        using namespace boost::icl;
-
-        interval_set<CharType> new_set;
-        for (auto&& interval : intervals) {
-            bool left_open =
-                (interval.bounds() == interval_bounds::left_open() ||
-                 interval.bounds() == interval_bounds::open());
-            bool right_open =
-                (interval.bounds() == interval_bounds::right_open() ||
-                 interval.bounds() == interval_bounds::open());
-
-            new_set.add(construct<discrete_interval<CharType>>(
-                interval.lower() + (left_open ? 1 : 0),
-                interval.upper() - (right_open ? 1 : 0),
-                interval_bounds::closed()
-            ));
-        }
-
-        std::swap(new_set, intervals);
-    }
+            // ((a)*)* is (a)*, and so is any other mix of different quantifiers
+            // e.g. ((a)+)? or ((a)?)+
+            if (_nodes[child].kind == regex_kind::quantifier) {
+                if (_nodes[child].oper != oper)
+                    oper = operator_type::star;
+                child = *begin(child);
+            }
+            return quantify(child, oper);
+        }
 
-    template <typename CharType, typename TokenInfo, typename T>
-    std::shared_ptr<regex_node<CharType, TokenInfo>> parse_char_range(
-        T& begin,
-        T end,
-        bool complement
-    ) {
-        using namespace boost::icl;
-        std::shared_ptr<character_set<CharType, TokenInfo>> expr(
-            new character_set<CharType, TokenInfo>()
-        );
-        CharType last;
+        /**
+         * Simplifies a list of (already simplified, non-alternative) alternatives:
+         * alternatives with a common head are left-factored, e.g. ab|ac becomes
+         * a(b|c), alternatives that are plain character sets are merged into a
+         * single set and an empty alternative turns the rest into an optional.
+         */
+        regex_id simplify_alternatives(const std::vector<regex_id>& items) {
+            std::vector<regex_id> heads;
+            std::vector<std::vector<regex_id>> tails;
+            std::unordered_map<regex_id, size_t> groups;
+            bool nullable = false;
+
+            for (auto&& item : items) {
+                if (empty(item)) {
+                    nullable = true;
+                    continue;
+                }
 
-        if (complement)
-            expr->char_set.add(construct<discrete_interval<CharType>>(
-                std::numeric_limits<CharType>::min(),
-                std::numeric_limits<CharType>::max(),
-                interval_bounds::closed()
-            ));
+                std::vector<regex_id> terms;
+                append_terms(terms, item);
+                terms.erase(terms.begin());
 
-        enum class states { normal, range, escape, escape_range };
+                auto head = _nodes[item].kind == regex_kind::concatenate ? *begin(item) : item;
+                auto status = groups.emplace(head, heads.size());
+                if (status.second) {
+                    heads.push_back(head);
+                    tails.emplace_back();
+                }
+                tails[status.first->second].push_back(concatenate(terms));
+            }
 
-        auto state = states::normal;
+            std::vector<regex_id> alternatives;
+            set_type merged;
+            bool merge = false;
+
+            for (size_t i = 0; i < heads.size(); ++i) {
+                auto tail = tails[i].front();
+                if (tails[i].size() > 1)
+                    tail = simplify(alternative(tails[i]));
+                if (empty(tail) && _nodes[heads[i]].kind == regex_kind::character_set) {
+                    merged += characters(heads[i]);
+                    merge = true;
+                    continue;
+                }
 
-        while (begin != end) {
-            switch (state) {
-                case states::normal:
-                    if (*begin == ']') {
-                        ++begin;
-                        make_closed(expr->char_set);
-                        return expr;
-                    }
-                    if (*begin == '\\') {
-                        state = states::escape;
-                        break;
-                    }
-                    if (*begin == '-') {
-                        state = states::range;
-                        break;
-                    } // no break;
-                case states::escape:
-                    last = *begin;
-                    if (complement)
-                        expr->char_set.subtract(last);
-                    else
-                        expr->char_set.add(last);
-                    state = states::normal;
-                    break;
-                case states::range:
-                    if (*begin == '\\') {
-                        state = states::escape_range;
-                        break;
-                    } // no break;
-                case states::escape_range:
-                    auto interval = boost::icl::construct<discrete_interval<CharType>>(
-                        last, *begin, interval_bounds::closed()
-                    );
-                    if (complement)
-                        expr->char_set.subtract(interval);
-                    else
-                        expr->char_set.add(interval);
-                    state = states::normal;
-                    break;
+                std::vector<regex_id> terms{ heads[i] };
+                append_terms(terms, tail);
+                alternatives.push_back(sequence(terms));
             }
-            ++begin;
-        }
 
-        throw std::runtime_error("Invalid regular expression - unterminated char range.");
-    }
+            if (merge)
+                alternatives.push_back(character_set(merged));
 
-    template <typename CharType, typename TokenInfo, typename T>
-    std::shared_ptr<regex_node<CharType, TokenInfo>> parse_atom(T& begin, T end) {
-        if (*begin == ']')
-            throw std::runtime_error("Invalid regular expression - unmatched ]");
-        if (*begin == '?' || *begin == '*' || *begin == ')' || *begin == '+' || *begin == '|')
-            return nullptr;
-        if (*begin == '(') {
-            ++begin;
-            auto node = parse_regex<CharType, TokenInfo>(begin, end);
-            if (*begin != ')')
-                throw std::runtime_error("Invalid regular expression - unterminated subexpression."
-                );
-            ++begin;
-            return node;
-        }
-        if (*begin == '[') {
-            ++begin;
-            bool complement = false;
-            if (*begin == '^') {
-                complement = true;
-                ++begin;
-            }
-            return parse_char_range<CharType, TokenInfo>(begin, end, complement);
-        }
-        if (*begin == '\\') {
-            ++begin;
-        }
-        return std::make_shared<character_set<CharType, TokenInfo>>(*begin++);
-    }
+            if (alternatives.empty())
+                return concatenate({});
 
-    template <typename CharType, typename TokenInfo, typename T>
-    std::shared_ptr<regex_node<CharType, TokenInfo>> parse_term(T& begin, T end) {
-        auto char_range = parse_atom<CharType, TokenInfo>(begin, end);
-        if (begin == end)
-            return char_range;
+            auto result = alternatives.front();
+            if (alternatives.size() > 1)
+                result = alternative(alternatives);
+            return nullable ? simplify_quantifier(result, operator_type::optional) : result;
+        }
 
-        switch (*begin++) {
-            case '+':
-                return std::make_shared<operand<CharType, TokenInfo>>(
-                    char_range, operator_type::plus
-                );
-            case '*':
-                return std::make_shared<operand<CharType, TokenInfo>>(
-                    char_range, operator_type::star
-                );
-            case '?':
-                return std::make_shared<operand<CharType, TokenInfo>>(
-                    char_range, operator_type::optional
-                );
-            default:
-                --begin;
-                return char_range;
+      public:
+        regex_id character_set(const set_type& chars) {
+            auto status = _set_index.emplace(chars, static_cast<uint32_t>(_sets.size()));
+            if (status.second)
+                _sets.push_back(chars);
+
+            _nodes.push_back(regex_expr{
+                regex_kind::character_set, operator_type::plus, status.first->second, 0 });
+            return intern();
         }
-    }
 
-    template <typename CharType, typename TokenInfo, typename T>
-    std::shared_ptr<regex_node<CharType, TokenInfo>> parse_factor(T& begin, T end) {
-        std::shared_ptr<concatenate<CharType, TokenInfo>> expr(new concatenate<CharType, TokenInfo>(
-        ));
+        regex_id concatenate(const std::vector<regex_id>& terms) {
+            return compound(regex_kind::concatenate, operator_type::plus, terms);
+        }
 
-        while (begin != end) {
-            auto new_term = parse_term<CharType, TokenInfo>(begin, end);
-            if (new_term.get() == nullptr)
-                return expr;
-            expr->terms.push_back(new_term);
+        regex_id alternative(const std::vector<regex_id>& alternatives) {
+            return compound(regex_kind::alternative, operator_type::plus, alternatives);
         }
 
-        return expr;
-    }
+        regex_id quantify(regex_id child, operator_type oper) {
+            if (child == no_regex) {
+                throw std::runtime_error("Cannot quantify an empty string.");
+            }
+            return compound(regex_kind::quantifier, oper, { child });
+        }
 
-    template <typename CharType, typename TokenInfo, typename T>
-    std::shared_ptr<regex_node<CharType, TokenInfo>> parse_regex(T& begin, T end) {
-        std::shared_ptr<alternative<CharType, TokenInfo>> expr(new alternative<CharType, TokenInfo>(
-        ));
+        /**
+         * Expands child{min,max} into min copies of the child followed by max - min
+         * nested optional ones, so x{2,4} is xx(x(x)?)?, which unlike xx(x)?(x)? has
+         * a single way to match every string. The copies are the same node, so the
+         * expression grows by an id per repetition.
+         */
+        regex_id repeat(regex_id child, size_t min, size_t max) {
+            if (child == no_regex) {
+                throw std::runtime_error("Cannot quantify an empty string.");
+            }
 
-        expr->alternatives.push_back(parse_factor<CharType, TokenInfo>(begin, end));
+            auto optional = concatenate({});
+            for (size_t i = min; i < max; ++i) {
+                auto copy = empty(optional) ? child : concatenate({ child, optional });
+                optional = quantify(copy, operator_type::optional);
+            }
 
-        while (begin != end && *begin == '|') {
-            ++begin;
-            expr->alternatives.push_back(parse_factor<CharType, TokenInfo>(begin, end));
+            std::vector<regex_id> terms(min, child);
+            terms.push_back(optional);
+            return concatenate(terms);
         }
 
-        return expr;
-    }
+        /**
+         * Expands child{min,} into min - 1 copies of the child followed by child+.
+         */
+        regex_id repeat(regex_id child, size_t min) {
+            if (min == 0)
+                return quantify(child, operator_type::star);
 
-    template <typename CharType, typename TokenInfo>
-    class nfa {
-        using node_type = nfa_node<CharType, TokenInfo>;
+            std::vector<regex_id> terms(min - 1, child);
+            terms.push_back(quantify(child, operator_type::plus));
+            return concatenate(terms);
+        }
 
-        node_type* _start;
+        regex_id parse(const std::basic_string<CharType>& regex) {
+            auto it = _parsed.find(regex);
+            if (it != _parsed.end())
+                return it->second;
 
-        nfa(const nfa& other) = delete;
-        nfa& operator=(const nfa&) = delete;
+            auto begin = regex.begin();
+            auto id = parse_regex(*this, begin, regex.end());
+            _parsed.emplace(regex, id);
+            return id;
+        }
+
+        /**
+         * Returns an equivalent, but smaller expression: nested concatenations and
+         * alternatives are flattened, single-element ones are unwrapped,
+         * alternatives are left-factored and their character sets merged, and
+         * redundant nesting of quantifiers is removed.
+         */
+        regex_id simplify(regex_id id) {
+            if (_simplified.size() < _nodes.size())
+                _simplified.resize(_nodes.size(), no_regex);
+            if (_simplified[id] != no_regex)
+                return _simplified[id];
+
+            auto expr = _nodes[id];
+            std::vector<regex_id> children(begin(id), end(id));
+            std::vector<regex_id> items;
+            regex_id result = id;
+
+            switch (expr.kind) {
+                case regex_kind::character_set:
+                    break;
+                case regex_kind::quantifier:
+                    result = simplify_quantifier(simplify(children.front()), expr.oper);
+                    break;
+                case regex_kind::concatenate:
+                    for (auto&& child : children)
+                        append_terms(items, simplify(child));
+                    result = sequence(items);
+                    break;
+                case regex_kind::alternative:
+                    for (auto&& child : children) {
+                        auto item = simplify(child);
+                        if (_nodes[item].kind == regex_kind::alternative)
+                            items.insert(items.end(), begin(item), end(item));
+                        else
+                            items.push_back(item);
+                    }
+                    result = simplify_alternatives(items);
+                    break;
+            }
+
+            _simplified.resize(_nodes.size(), no_regex);
+            _simplified[id] = result;
+            _simplified[result] = result;
+            return result;
+        }
+
+        const regex_expr& operator[](regex_id id) const {
+            return _nodes[id];
+        }
+
+        const regex_id* begin(regex_id id) const {
+            return _children.data() + _nodes[id].first;
+        }
+
+        const regex_id* end(regex_id id) const {
+            return begin(id) + _nodes[id].count;
+        }
+
+        const set_type& characters(regex_id id) const {
+            return _sets[_nodes[id].first];
+        }
+
+        size_t size() const {
+            return _nodes.size();
+        }
+    };
+
+    /**
+     * Bookkeeping for the position (Glushkov) automaton construction. Every
+     * character set occurring in the regex is a position; followpos of each
+     * position is accumulated here while nullable/firstpos/lastpos are passed up
+     * the syntax tree.
+     */
+    struct position_table {
+        std::vector<regex_id> characters;
+        std::vector<std::vector<size_t>> follow;
+
+        size_t add(regex_id chars) {
+            characters.push_back(chars);
+            follow.emplace_back();
+            return characters.size() - 1;
+        }
+
+        void link(const std::vector<size_t>& from, const std::vector<size_t>& to) {
+            for (auto&& position : from) {
+                follow[position].insert(follow[position].end(), to.begin(), to.end());
+            }
+        }
+    };
+
+    struct position_set {
+        bool nullable;
+        std::vector<size_t> first;
+        std::vector<size_t> last;
+
+        position_set() : nullable(true) {
+        }
+    };
+
+    template <typename CharType>
+    position_set positions(const regex_arena<CharType>& arena, regex_id id, position_table& table) {
+        position_set result;
+        const auto& expr = arena[id];
+
+        switch (expr.kind) {
+            case regex_kind::character_set: {
+                auto position = table.add(id);
+                result.nullable = false;
+                result.first.push_back(position);
+                result.last.push_back(position);
+                break;
+            }
+            case regex_kind::quantifier:
+                result = positions(arena, *arena.begin(id), table);
+                if (expr.oper != operator_type::optional)
+                    table.link(result.last, result.first);
+                if (expr.oper != operator_type::plus)
+                    result.nullable = true;
+                break;
+            case regex_kind::concatenate:
+                for (auto it = arena.begin(id); it != arena.end(id); ++it) {
+                    position_set child = positions(arena, *it, table);
+                    table.link(result.last, child.first);
+
+                    if (result.nullable) {
+                        result.first.insert(
+                            result.first.end(), child.first.begin(), child.first.end()
+                        );
+                    }
+                    if (!child.nullable)
+                        result.last.clear();
+                    result.last.insert(result.last.end(), child.last.begin(), child.last.end());
+                    result.nullable = result.nullable && child.nullable;
+                }
+                break;
+            case regex_kind::alternative:
+                result.nullable = false;
+                for (auto it = arena.begin(id); it != arena.end(id); ++it) {
+                    position_set child = positions(arena, *it, table);
+                    result.first.insert(result.first.end(), child.first.begin(), child.first.end());
+                    result.last.insert(result.last.end(), child.last.begin(), child.last.end());
+                    result.nullable = result.nullable || child.nullable;
+                }
+                break;
+        }
+
+        return result;
+    }
+
+    /**
+     * Enumerates the words of a regex with a finite language, e.g. a literal or
+     * an alternative of literals. Returns false if the language is infinite or
+     * has more than `limit` words.
+     */
+    template <typename CharType>
+    bool finite_language(
+        const regex_arena<CharType>& arena,
+        regex_id id,
+        std::vector<std::basic_string<CharType>>& words,
+        size_t limit
+    ) {
+        const auto& expr = arena[id];
+        std::vector<std::basic_string<CharType>> result;
+
+        switch (expr.kind) {
+            case regex_kind::character_set:
+                for (auto&& interval : arena.characters(id)) {
+                    if (interval.length() > limit - result.size())
+                        return false;
+                    for (auto ch = interval.lower;; ++ch) {
+                        result.emplace_back(1, ch);
+                        if (ch == interval.upper)
+                            break;
+                    }
+                }
+                break;
+            case regex_kind::quantifier:
+                if (expr.oper != operator_type::optional)
+                    return false;
+                result.emplace_back();
+                if (!finite_language(arena, *arena.begin(id), result, limit))
+                    return false;
+                break;
+            case regex_kind::concatenate:
+                result.emplace_back();
+                for (auto it = arena.begin(id); it != arena.end(id); ++it) {
+                    std::vector<std::basic_string<CharType>> suffixes, product;
+                    if (!finite_language(arena, *it, suffixes, limit))
+                        return false;
+                    if (suffixes.size() > limit / result.size())
+                        return false;
+                    for (auto&& prefix : result) {
+                        for (auto&& suffix : suffixes)
+                            product.push_back(prefix + suffix);
+                    }
+                    result.swap(product);
+                    if (result.empty())
+                        break;
+                }
+                break;
+            case regex_kind::alternative:
+                for (auto it = arena.begin(id); it != arena.end(id); ++it) {
+                    if (!finite_language(arena, *it, result, limit))
+                        return false;
+                }
+                break;
+        }
+
+        if (result.size() > limit - words.size())
+            return false;
+        words.insert(words.end(), result.begin(), result.end());
+        return true;
+    }
+
+    enum class nfa_construction { thompson, position };
+
+    /**
+     * Thompson's construction of the NFA fragment for a subexpression.
+     */
+    template <typename CharType, typename TokenInfo>
+    nfa_segment<CharType, TokenInfo> thompson(const regex_arena<CharType>& arena, regex_id id) {
+        using node_type = nfa_node<CharType, TokenInfo>;
+        using transition_type = nfa_transition<CharType, TokenInfo>;
+        const auto& expr = arena[id];
+
+        switch (expr.kind) {
+            case regex_kind::character_set: {
+                nfa_segment<CharType, TokenInfo> result(new node_type(), new node_type());
+                result.begin->transitions.push_back(
+                    transition_type(arena.characters(id), result.end)
+                );
+                return result;
+            }
+            case regex_kind::quantifier: {
+                auto child_nfa = thompson<CharType, TokenInfo>(arena, *arena.begin(id));
+                nfa_segment<CharType, TokenInfo> result(new node_type(), new node_type());
+                switch (expr.oper) {
+                    case operator_type::plus:
+                        child_nfa.end->transitions.push_back(transition_type(child_nfa.begin));
+                        break;
+                    case operator_type::star:
+                        result.begin->transitions.push_back(transition_type(result.end));
+                        child_nfa.end->transitions.push_back(transition_type(child_nfa.begin));
+                        break;
+                    case operator_type::optional:
+                        result.begin->transitions.push_back(transition_type(result.end));
+                        break;
+                    default:
+                        break;
+                }
+                result.begin->transitions.push_back(transition_type(child_nfa.begin));
+                child_nfa.end->transitions.push_back(transition_type(result.end));
+                return result;
+            }
+            case regex_kind::concatenate: {
+                node_type* first = new node_type();
+                node_type* last = first;
+
+                for (auto it = arena.begin(id); it != arena.end(id); ++it) {
+                    auto child_nfa = thompson<CharType, TokenInfo>(arena, *it);
+                    for (auto&& transition : child_nfa.begin->transitions) {
+                        last->transitions.push_back(transition);
+                    }
+                    // Nothing refers to the begin node of a fragment yet.
+                    if (child_nfa.begin != child_nfa.end)
+                        delete child_nfa.begin;
+                    last = child_nfa.end;
+                }
+
+                return nfa_segment<CharType, TokenInfo>(first, last);
+            }
+            default: {
+                nfa_segment<CharType, TokenInfo> result(new node_type(), new node_type());
+
+                for (auto it = arena.begin(id); it != arena.end(id); ++it) {
+                    auto child_nfa = thompson<CharType, TokenInfo>(arena, *it);
+                    result.begin->transitions.push_back(transition_type(child_nfa.begin));
+                    child_nfa.end->transitions.push_back(transition_type(result.end));
+                }
+
+                return result;
+            }
+        }
+    }
+
+    template <typename CharType, typename T>
+    regex_id parse_char_range(regex_arena<CharType>& arena, T& begin, T end, bool complement) {
+        range_set<CharType> char_set;
+        CharType last;
+
+        if (complement)
+            char_set.add(
+                std::numeric_limits<CharType>::min(), std::numeric_limits<CharType>::max()
+            );
+
+        enum class states { normal, range, escape, escape_range };
+
+        auto state = states::normal;
+
+        while (begin != end) {
+            switch (state) {
+                case states::normal:
+                    if (*begin == ']') {
+                        ++begin;
+                        return arena.character_set(char_set);
+                    }
+                    if (*begin == '\\') {
+                        state = states::escape;
+                        break;
+                    }
+                    if (*begin == '-') {
+                        state = states::range;
+                        break;
+                    } // no break;
+                case states::escape:
+                    last = *begin;
+                    if (complement)
+                        char_set.subtract(last);
+                    else
+                        char_set.add(last);
+                    state = states::normal;
+                    break;
+                case states::range:
+                    if (*begin == '\\') {
+                        state = states::escape_range;
+                        break;
+                    } // no break;
+                case states::escape_range:
+                    if (complement)
+                        char_set.subtract(last, *begin);
+                    else
+                        char_set.add(last, *begin);
+                    state = states::normal;
+                    break;
+            }
+            ++begin;
+        }
+
+        throw std::runtime_error("Invalid regular expression - unterminated char range.");
+    }
+
+    template <typename CharType, typename T>
+    regex_id parse_atom(regex_arena<CharType>& arena, T& begin, T end) {
+        if (*begin == ']')
+            throw std::runtime_error("Invalid regular expression - unmatched ]");
+        if (*begin == '?' || *begin == '*' || *begin == ')' || *begin == '+' || *begin == '|')
+            return no_regex;
+        if (*begin == '(') {
+            ++begin;
+            auto node = parse_regex(arena, begin, end);
+            if (*begin != ')')
+                throw std::runtime_error("Invalid regular expression - unterminated subexpression."
+                );
+            ++begin;
+            return node;
+        }
+        if (*begin == '[') {
+            ++begin;
+            bool complement = false;
+            if (*begin == '^') {
+                complement = true;
+                ++begin;
+            }
+            return parse_char_range(arena, begin, end, complement);
+        }
+        if (*begin == '\\') {
+            ++begin;
+        }
+        range_set<CharType> char_set;
+        char_set.add(*begin++);
+        return arena.character_set(char_set);
+    }
+
+    /**
+     * Largest bound of a repetition. Repetitions are expanded, so larger bounds
+     * would only produce huge automata.
+     */
+    constexpr size_t max_repetitions = 1000;
+
+    /**
+     * Parses the bounds of a repetition {m}, {m,} or {m,n} at the opening brace.
+     * Returns false and leaves begin untouched if there is none, in which case
+     * the brace is a literal character.
+     */
+    template <typename T>
+    bool parse_bounds(T& begin, T end, size_t& min, size_t& max, bool& bounded) {
+        auto position = begin;
+        auto number = [&](size_t& value) {
+            auto first = position;
+            for (value = 0; position != end && *position >= '0' && *position <= '9';
+                 ++position) {
+                auto digit = static_cast<size_t>(*position - '0');
+                value = std::min(value * 10 + digit, max_repetitions + 1);
+            }
+            return position != first;
+        };
+
+        ++position;
+        if (!number(min))
+            return false;
+        max = min;
+        bounded = true;
+        if (position != end && *position == ',') {
+            ++position;
+            bounded = number(max);
+        }
+        if (position == end || *position != '}')
+            return false;
+
+        begin = ++position;
+        return true;
+    }
+
+    template <typename CharType, typename T>
+    regex_id parse_term(regex_arena<CharType>& arena, T& begin, T end) {
+        auto char_range = parse_atom(arena, begin, end);
+        if (begin == end)
+            return char_range;
+
+        size_t min, max;
+        bool bounded;
+        if (*begin == '{' && parse_bounds(begin, end, min, max, bounded)) {
+            if (min > max_repetitions || (bounded && max > max_repetitions))
+                throw std::runtime_error("Invalid regular expression - repetition too large.");
+            if (bounded && max < min)
+                throw std::runtime_error("Invalid regular expression - repetition out of order."
+                );
+            return bounded ? arena.repeat(char_range, min, max) : arena.repeat(char_range, min);
+        }
+
+        switch (*begin++) {
+            case '+':
+                return arena.quantify(char_range, operator_type::plus);
+            case '*':
+                return arena.quantify(char_range, operator_type::star);
+            case '?':
+                return arena.quantify(char_range, operator_type::optional);
+            default:
+                --begin;
+                return char_range;
+        }
+    }
+
+    template <typename CharType, typename T>
+    regex_id parse_factor(regex_arena<CharType>& arena, T& begin, T end) {
+        std::vector<regex_id> terms;
+
+        while (begin != end) {
+            auto new_term = parse_term(arena, begin, end);
+            if (new_term == no_regex)
+                break;
+            terms.push_back(new_term);
+        }
+
+        return arena.concatenate(terms);
+    }
+
+    template <typename CharType, typename T>
+    regex_id parse_regex(regex_arena<CharType>& arena, T& begin, T end) {
+        std::vector<regex_id> alternatives;
+
+        alternatives.push_back(parse_factor(arena, begin, end));
+
+        while (begin != end && *begin == '|') {
+            ++begin;
+            alternatives.push_back(parse_factor(arena, begin, end));
+        }
+
+        return arena.alternative(alternatives);
+    }
+
+    /**
+     * Builds the minimal deterministic acyclic automaton accepting exactly the
+     * given words with the incremental algorithm for sorted input of Daciuk et
+     * al. (Incremental Construction of Minimal Acyclic Finite-State Automata).
+     * Only the states along the path of the last added word are not minimized
+     * yet, so time and memory are linear in the size of the input. Returns the
+     * root of the automaton; all its accepting nodes emit the given token.
+     */
+    template <typename CharType, typename TokenInfo>
+    nfa_node<CharType, TokenInfo>* build_dictionary(
+        std::vector<std::basic_string<CharType>> words,
+        const TokenInfo& token
+    ) {
+        using node_type = nfa_node<CharType, TokenInfo>;
+
+        struct state {
+            bool final;
+            std::vector<std::pair<CharType, uint32_t>> edges;
+        };
+
+        std::vector<state> states(1, state{ false, {} });
+        std::vector<uint32_t> free_states;
+
+        auto hash = [&](uint32_t id) {
+            size_t hash = 2166136261;
+            hash = hash * 16777619 ^ static_cast<size_t>(states[id].final);
+            for (auto&& edge : states[id].edges) {
+                hash = hash * 16777619 ^ static_cast<size_t>(edge.first);
+                hash = hash * 16777619 ^ edge.second;
+            }
+            return hash;
+        };
+        auto equal = [&](uint32_t x, uint32_t y) {
+            return states[x].final == states[y].final && states[x].edges == states[y].edges;
+        };
+        std::unordered_set<uint32_t, decltype(hash), decltype(equal)> registry(16, hash, equal);
+
+        // States along the path of the previously added word, starting with the root.
+        std::vector<uint32_t> path{ 0 };
+
+        auto replace_or_register = [&](size_t depth) {
+            for (size_t i = path.size() - 1; i > depth; --i) {
+                auto status = registry.insert(path[i]);
+                if (!status.second) {
+                    states[path[i - 1]].edges.back().second = *status.first;
+                    states[path[i]].edges.clear();
+                    free_states.push_back(path[i]);
+                }
+            }
+            path.resize(depth + 1);
+        };
+
+        std::sort(words.begin(), words.end());
+        const std::basic_string<CharType>* previous = nullptr;
+
+        for (auto&& word : words) {
+            size_t common = 0;
+            if (previous != nullptr) {
+                if (*previous == word)
+                    continue;
+                auto limit = std::min(word.size(), previous->size());
+                while (common < limit && word[common] == (*previous)[common])
+                    ++common;
+            }
+
+            replace_or_register(common);
+
+            for (size_t i = common; i < word.size(); ++i) {
+                uint32_t next = static_cast<uint32_t>(states.size());
+                if (free_states.empty()) {
+                    states.push_back(state{ false, {} });
+                } else {
+                    next = free_states.back();
+                    free_states.pop_back();
+                    states[next].final = false;
+                }
+                states[path.back()].edges.emplace_back(word[i], next);
+                path.push_back(next);
+            }
+
+            states[path.back()].final = true;
+            previous = &word;
+        }
+
+        replace_or_register(0);
+
+        std::vector<node_type*> nodes(states.size(), nullptr);
+        std::vector<uint32_t> to_visit{ 0 };
+        nodes[0] = new node_type();
+
+        while (!to_visit.empty()) {
+            auto id = to_visit.back();
+            auto node = nodes[id];
+            to_visit.pop_back();
+
+            node->terminal = states[id].final;
+            if (node->terminal)
+                node->token = token;
+
+            // Characters leading to the same state share a single transition.
+            std::unordered_map<uint32_t, size_t> targets;
+            for (auto&& edge : states[id].edges) {
+                if (nodes[edge.second] == nullptr) {
+                    nodes[edge.second] = new node_type();
+                    to_visit.push_back(edge.second);
+                }
+
+                auto status = targets.emplace(edge.second, node->transitions.size());
+                if (status.second) {
+                    node->transitions.emplace_back(range_set<CharType>(), nodes[edge.second]);
+                }
+                node->transitions[status.first->second].characters.add(edge.first);
+            }
+        }
+
+        return nodes[0];
+    }
+
+    /**
+     * Size of an NFA.
+     */
+    struct nfa_size {
+        size_t nodes;
+        size_t transitions;
+
+        nfa_size() : nodes(0), transitions(0) {
+        }
+
+        nfa_size& operator+=(const nfa_size& other) {
+            nodes += other.nodes;
+            transitions += other.transitions;
+            return *this;
+        }
+    };
+
+    /**
+     * Size of an NFA before and after nfa::simplify().
+     */
+    struct nfa_reduction {
+        nfa_size before;
+        nfa_size after;
+
+        nfa_reduction& operator+=(const nfa_reduction& other) {
+            before += other.before;
+            after += other.after;
+            return *this;
+        }
+    };
+
+    template <typename CharType, typename TokenInfo>
+    class nfa {
+        using node_type = nfa_node<CharType, TokenInfo>;
+
+        /* Start node of every mode, see lexer_production::modes. */
+        std::vector<node_type*> _starts;
+
+        nfa(const nfa& other) = delete;
+        nfa& operator=(const nfa&) = delete;
+
+        static void make_terminal(node_type* node, const TokenInfo& token_info) {
+            if (!node->terminal || token_info < node->token) {
+                node->terminal = true;
+                node->token = token_info;
+            }
+        }
+
+        /**
+         * Builds the epsilon-free position automaton of the regex directly from
+         * nullable/firstpos/lastpos/followpos (Compilers: Principles, Techniques
+         * and Tools SE, section 3.9) and hangs it off the given start node.
+         */
+        static void add_positions(
+            node_type* start,
+            const regex_arena<CharType>& arena,
+            regex_id regex,
+            const TokenInfo& token_info
+        ) {
+            position_table table;
+            auto root = positions(arena, regex, table);
+
+            std::vector<node_type*> nodes;
+            for (size_t i = 0; i < table.characters.size(); ++i)
+                nodes.push_back(new node_type());
+
+            auto connect = [&](node_type* from, std::vector<size_t>& targets) {
+                std::sort(targets.begin(), targets.end());
+                targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+                for (auto&& target : targets) {
+                    from->transitions.emplace_back(
+                        arena.characters(table.characters[target]), nodes[target]
+                    );
+                }
+            };
+
+            connect(start, root.first);
+            for (size_t i = 0; i < nodes.size(); ++i)
+                connect(nodes[i], table.follow[i]);
+
+            for (auto&& position : root.last)
+                make_terminal(nodes[position], token_info);
+            if (root.nullable)
+                make_terminal(start, token_info);
+        }
+
+        /* Nodes reachable from the start nodes, in breadth-first order. */
+        std::vector<node_type*> nodes() const {
+            std::vector<node_type*> result;
+            std::unordered_set<node_type*> visited;
+            for (auto&& start : _starts) {
+                if (visited.insert(start).second)
+                    result.push_back(start);
+            }
+            for (size_t i = 0; i < result.size(); ++i) {
+                for (auto&& transition : result[i]->transitions) {
+                    if (visited.insert(transition.next).second)
+                        result.push_back(transition.next);
+                }
+            }
+            return result;
+        }
+
+        static nfa_size measure(const std::vector<node_type*>& nodes) {
+            nfa_size result;
+            result.nodes = nodes.size();
+            for (auto&& node : nodes)
+                result.transitions += node->transitions.size();
+            return result;
+        }
+
+        /**
+         * Bypasses non-accepting nodes whose only transition is an epsilon one
+         * (e.g. the end nodes of Thompson's fragments), and merges nodes whose
+         * only incoming transition is an epsilon one into its source (e.g. the
+         * begin nodes of alternatives).
+         */
+        void contract_epsilons() {
+            auto all = nodes();
+
+            std::unordered_map<node_type*, node_type*> alias;
+            for (auto&& node : all) {
+                if (!node->terminal && node->transitions.size() == 1 &&
+                    node->transitions.front().epsilon && node->transitions.front().next != node)
+                    alias.emplace(node, node->transitions.front().next);
+            }
+
+            // A cycle of such nodes cannot accept anything, so it does not
+            // matter which of its nodes the chain ends at.
+            auto resolve = [&alias](node_type* node) {
+                for (size_t steps = 0; steps <= alias.size(); ++steps) {
+                    auto it = alias.find(node);
+                    if (it == alias.end())
+                        break;
+                    node = it->second;
+                }
+                return node;
+            };
+
+            for (auto&& start : _starts)
+                start = resolve(start);
+            for (auto&& node : all) {
+                for (auto&& transition : node->transitions)
+                    transition.next = resolve(transition.next);
+            }
+
+            all = nodes();
+            std::unordered_map<node_type*, size_t> incoming;
+            for (auto&& start : _starts)
+                ++incoming[start];
+            for (auto&& node : all) {
+                for (auto&& transition : node->transitions)
+                    ++incoming[transition.next];
+            }
+
+            for (auto&& node : all) {
+                for (size_t i = 0; i < node->transitions.size();) {
+                    auto next = node->transitions[i].next;
+                    if (!node->transitions[i].epsilon || next == node || incoming[next] != 1) {
+                        ++i;
+                        continue;
+                    }
+
+                    node->transitions.erase(node->transitions.begin() + i);
+                    node->transitions.insert(
+                        node->transitions.end(), next->transitions.begin(), next->transitions.end()
+                    );
+                    if (next->terminal)
+                        make_terminal(node, next->token);
+                    next->transitions.clear();
+                    incoming[next] = 0;
+                }
+            }
+        }
+
+        /* Removes the transitions to nodes from which no accepting node can be
+         * reached. */
+        void remove_dead() {
+            auto all = nodes();
+            std::unordered_map<node_type*, std::vector<node_type*>> sources;
+            std::vector<node_type*> live;
+            std::unordered_set<node_type*> is_live;
+            for (auto&& node : all) {
+                if (node->terminal && is_live.insert(node).second)
+                    live.push_back(node);
+                for (auto&& transition : node->transitions)
+                    sources[transition.next].push_back(node);
+            }
+
+            for (size_t i = 0; i < live.size(); ++i) {
+                for (auto&& source : sources[live[i]]) {
+                    if (is_live.insert(source).second)
+                        live.push_back(source);
+                }
+            }
+
+            for (auto&& node : all) {
+                auto& transitions = node->transitions;
+                transitions.erase(
+                    std::remove_if(
+                        transitions.begin(),
+                        transitions.end(),
+                        [&is_live](const nfa_transition<CharType, TokenInfo>& transition) {
+                            return is_live.count(transition.next) == 0;
+                        }
+                    ),
+                    transitions.end()
+                );
+            }
+        }
+
+        /**
+         * Merges bisimilar nodes, found by partition refinement: two nodes are
+         * forward bisimilar if they accept the same token and have transitions
+         * on the same labels to bisimilar nodes, so they accept the same
+         * language, and backward bisimilar if they have transitions from
+         * bisimilar nodes on the same labels, so any input that leads to one of
+         * them leads to the other one as well. Merged forward bisimilar nodes
+         * keep the transitions of one of them, backward bisimilar ones get the
+         * transitions of all of them.
+         */
+        bool merge_bisimilar(bool backward) {
+            auto all = nodes();
+            std::unordered_map<node_type*, size_t> index;
+            for (size_t i = 0; i < all.size(); ++i)
+                index.emplace(all[i], i);
+
+            // Edges as (label, other node) by node, epsilon is label 0.
+            std::unordered_map<range_set<CharType>, size_t, range_set_hash<CharType>> labels;
+            std::vector<std::vector<std::pair<size_t, size_t>>> edges(all.size());
+            for (size_t i = 0; i < all.size(); ++i) {
+                for (auto&& transition : all[i]->transitions) {
+                    size_t label = 0;
+                    if (!transition.epsilon)
+                        label = labels.emplace(transition.characters, labels.size() + 1)
+                                    .first->second;
+                    auto j = index[transition.next];
+                    if (backward)
+                        edges[j].emplace_back(label, i);
+                    else
+                        edges[i].emplace_back(label, j);
+                }
+            }
+
+            // Backward, the start nodes of different modes are never merged.
+            std::vector<size_t> block(all.size(), 0);
+            std::map<TokenInfo, size_t> tokens;
+            for (size_t i = _starts.size(); i-- > 0;) {
+                if (backward)
+                    block[index[_starts[i]]] = i + 1;
+            }
+            for (size_t i = 0; i < all.size(); ++i) {
+                if (!backward && all[i]->terminal)
+                    block[i] = tokens.emplace(all[i]->token, tokens.size() + 1).first->second;
+            }
+
+            // The signatures of all the nodes are stored one after another, and
+            // the nodes are hashed by their signatures, so a round does not
+            // allocate anything once the buffers have grown.
+            std::vector<size_t> signatures, offsets(all.size() + 1);
+            std::vector<size_t> next(all.size());
+            std::vector<std::pair<size_t, size_t>> targets;
+
+            auto signature_hash = [&](size_t i) {
+                size_t hash = 2166136261;
+                for (auto j = offsets[i]; j < offsets[i + 1]; ++j)
+                    hash = hash * 16777619 ^ signatures[j];
+                return hash;
+            };
+            auto signature_eq = [&](size_t i, size_t j) {
+                return offsets[i + 1] - offsets[i] == offsets[j + 1] - offsets[j] &&
+                       std::equal(
+                           signatures.begin() + offsets[i],
+                           signatures.begin() + offsets[i + 1],
+                           signatures.begin() + offsets[j]
+                       );
+            };
+            std::unordered_map<size_t, size_t, decltype(signature_hash), decltype(signature_eq)>
+                blocks(all.size(), signature_hash, signature_eq);
+
+            for (size_t count = 0;;) {
+                signatures.clear();
+                for (size_t i = 0; i < all.size(); ++i) {
+                    targets.clear();
+                    for (auto&& edge : edges[i])
+                        targets.emplace_back(edge.first, block[edge.second]);
+                    std::sort(targets.begin(), targets.end());
+                    targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+
+                    offsets[i] = signatures.size();
+                    signatures.push_back(block[i]);
+                    for (auto&& target : targets) {
+                        signatures.push_back(target.first);
+                        signatures.push_back(target.second);
+                    }
+                }
+                offsets[all.size()] = signatures.size();
+
+                blocks.clear();
+                for (size_t i = 0; i < all.size(); ++i)
+                    next[i] = blocks.emplace(i, blocks.size()).first->second;
+
+                block.swap(next);
+                if (blocks.size() == count)
+                    break;
+                count = blocks.size();
+            }
+
+            std::unordered_map<size_t, node_type*> representatives;
+            for (size_t i = 0; i < all.size(); ++i)
+                representatives.emplace(block[i], all[i]);
+            if (representatives.size() == all.size())
+                return false;
+
+            for (size_t i = 0; i < all.size(); ++i) {
+                auto representative = representatives[block[i]];
+                if (representative == all[i])
+                    continue;
+                if (backward) {
+                    representative->transitions.insert(
+                        representative->transitions.end(),
+                        all[i]->transitions.begin(),
+                        all[i]->transitions.end()
+                    );
+                    if (all[i]->terminal)
+                        make_terminal(representative, all[i]->token);
+                }
+                all[i]->transitions.clear();
+            }
+
+            for (auto&& node : all) {
+                for (auto&& transition : node->transitions)
+                    transition.next = representatives[block[index[transition.next]]];
+            }
+            for (auto&& start : _starts)
+                start = representatives[block[index[start]]];
+            return true;
+        }
+
+        /* Joins the transitions of each node leading to the same node and drops
+         * epsilon loops. */
+        void merge_transitions() {
+            for (auto&& node : nodes()) {
+                std::vector<nfa_transition<CharType, TokenInfo>> merged;
+                std::unordered_map<node_type*, size_t> targets;
+                std::unordered_set<node_type*> epsilons;
+
+                for (auto&& transition : node->transitions) {
+                    if (transition.epsilon) {
+                        if (transition.next != node && epsilons.insert(transition.next).second)
+                            merged.push_back(transition);
+                        continue;
+                    }
+                    auto status = targets.emplace(transition.next, merged.size());
+                    if (status.second)
+                        merged.push_back(transition);
+                    else
+                        merged[status.first->second].characters += transition.characters;
+                }
+
+                node->transitions.swap(merged);
+            }
+        }
+
+        /* Links the start node of every mode in the mask to the entry of a
+         * fragment by taking over its transitions, so that no epsilon
+         * transition is added. */
+        void link(const node_type& entry, uint64_t modes) {
+            for (size_t mode = 0; mode < _starts.size(); ++mode) {
+                if (((modes >> mode) & 1) == 0)
+                    continue;
+                auto start = _starts[mode];
+                start->transitions.insert(
+                    start->transitions.end(), entry.transitions.begin(), entry.transitions.end()
+                );
+                if (entry.terminal)
+                    make_terminal(start, entry.token);
+            }
+        }
+
+        template <class Iterator>
+        void add_productions(
+            regex_arena<CharType>& arena,
+            Iterator begin,
+            Iterator end,
+            nfa_construction construction,
+            size_t modes
+        ) {
+            for (size_t mode = 0; mode < modes; ++mode)
+                _starts.push_back(new node_type());
+
+            for (; begin != end; ++begin) {
+                auto root = arena.simplify(arena.parse(begin->regex));
+                if (construction == nfa_construction::position) {
+                    node_type entry;
+                    add_positions(&entry, arena, root, begin->token);
+                    link(entry, begin->modes);
+                    continue;
+                }
+                auto thunk = thompson<CharType, TokenInfo>(arena, root);
+                thunk.end->terminal = true;
+                thunk.end->token = begin->token;
+                node_type entry;
+                entry.transitions.emplace_back(thunk.begin);
+                link(entry, begin->modes);
+            }
+        }
+
+      public:
+        nfa(
+            const std::basic_string<CharType>& regex,
+            TokenInfo token_info,
+            nfa_construction construction = nfa_construction::thompson
+        ) {
+            regex_arena<CharType> arena;
+            auto root = arena.simplify(arena.parse(regex));
+            if (construction == nfa_construction::position) {
+                _starts.push_back(new node_type());
+                add_positions(_starts.front(), arena, root, token_info);
+                return;
+            }
+            auto thunk = thompson<CharType, TokenInfo>(arena, root);
+            thunk.end->terminal = true;
+            thunk.end->token = token_info;
+            _starts.push_back(thunk.begin);
+        }
+
+        /**
+         * Builds the NFA for all the productions, with a start node for each of
+         * the given number of modes. Regexes are parsed into the given arena,
+         * so it can be reused to share the parsed syntax trees between several
+         * NFAs.
+         */
+        template <class Iterator>
+        nfa(
+            regex_arena<CharType>& arena,
+            Iterator begin,
+            Iterator end,
+            nfa_construction construction = nfa_construction::thompson,
+            size_t modes = 1
+        ) {
+            add_productions(arena, begin, end, construction, modes);
+        }
+
+        template <class Iterator>
+        nfa(
+            Iterator begin,
+            Iterator end,
+            nfa_construction construction = nfa_construction::thompson,
+            size_t modes = 1
+        ) {
+            regex_arena<CharType> arena;
+            add_productions(arena, begin, end, construction, modes);
+        }
+
+        /**
+         * Builds the NFA of a dictionary of literal words, see add_dictionary().
+         */
+        nfa(const std::vector<std::basic_string<CharType>>& words, const TokenInfo& token_info)
+          : _starts{ build_dictionary(words, token_info) } {
+        }
+
+        /**
+         * Adds a dictionary of literal words to the given modes. Its minimal
+         * acyclic automaton is built directly and merged into the start nodes,
+         * bypassing the regex machinery entirely.
+         */
+        void add_dictionary(
+            const std::vector<std::basic_string<CharType>>& words,
+            const TokenInfo& token_info,
+            uint64_t modes = 1
+        ) {
+            auto root = build_dictionary(words, token_info);
+            link(*root, modes);
+            delete root;
+        }
+
+        const node_type& start() const {
+            return *_starts.front();
+        }
+
+        node_type& start() {
+            return *_starts.front();
+        }
+
+        const node_type& start(size_t mode) const {
+            return *_starts.at(mode);
+        }
+
+        size_t modes() const {
+            return _starts.size();
+        }
+
+        /**
+         * Shrinks the NFA without changing the tokens it accepts, which makes
+         * the epsilon-closures and moves of the subset construction cheaper:
+         * epsilon transitions are contracted where possible, nodes that cannot
+         * lead to an accepting node are removed, and bisimilar nodes are merged.
+         * The start nodes may change.
+         */
+        nfa_reduction simplify() {
+            auto original = nodes();
+            nfa_reduction result;
+            result.before = measure(original);
+
+            for (auto size = result.before;;) {
+                contract_epsilons();
+                remove_dead();
+                merge_bisimilar(false);
+                merge_bisimilar(true);
+                merge_transitions();
+
+                auto current = measure(nodes());
+                if (current.nodes == size.nodes && current.transitions == size.transitions)
+                    break;
+                size = current;
+            }
+
+            auto remaining = nodes();
+            std::unordered_set<node_type*> kept(remaining.begin(), remaining.end());
+            for (auto&& node : original) {
+                if (kept.count(node) == 0)
+                    delete node;
+            }
+
+            result.after = measure(remaining);
+            return result;
+        }
+
+        ~nfa() {
+            for (auto&& node : nodes())
+                delete node;
+        }
+    };
+
+    template <typename CharType, typename TokenInfo>
+    struct dfa_node;
+
+    /**
+     * Transition on a closed interval of characters. Transitions of a DFA state
+     * are disjoint and sorted by their lower bound.
+     */
+    template <typename CharType, typename TokenInfo>
+    struct dfa_transition {
+        using node_type = dfa_node<CharType, TokenInfo>;
+
+        CharType lower;
+        CharType upper;
+        node_type* next;
+
+        dfa_transition(CharType lower_, CharType upper_, node_type* next_)
+          : lower(lower_), upper(upper_), next(next_) {
+        }
+    };
+
+    template <typename CharType, typename TokenInfo>
+    struct dfa_node {
+        using nfa_node_type = nfa_node<CharType, TokenInfo>;
+
+        /* Sorted set of NFA states, only kept during the subset construction. */
+        std::vector<const nfa_node_type*> nodes;
+        std::vector<dfa_transition<CharType, TokenInfo>> transitions;
+
+        bool accepting;
+        TokenInfo token;
+
+        explicit dfa_node(const std::vector<const nfa_node_type*>& nfa_nodes)
+          : nodes(nfa_nodes), accepting(false) {
+        }
+
+        dfa_node() : accepting(false) {
+        }
+
+        /**
+         * Resolves the token emitted by this state (the one with the highest
+         * precedence) and releases the set of NFA states.
+         */
+        void freeze() {
+            for (auto&& nfa_node : nodes) {
+                if (nfa_node->terminal && (!accepting || nfa_node->token < token)) {
+                    accepting = true;
+                    token = nfa_node->token;
+                }
+            }
+            std::vector<const nfa_node_type*>().swap(nodes);
+        }
+
+        bool terminal() const {
+            return accepting;
+        }
+
+        const TokenInfo& get_terminal() const {
+            return token;
+        }
+    };
+
+    /**
+     * Returns all states reachable from any of the input NFA states by following
+     * a transition containing specified interval (this is a generalization of
+     * move(T, a) for alphabet symbol a to intervals of symbols)
+     */
+    template <typename T, typename CharType, typename TokenInfo>
+    void move_s(
+        std::vector<const nfa_node<CharType, TokenInfo>*>& dest,
+        const T& nodes,
+        const typename range_set<CharType>::interval& chars
+    ) {
+        for (auto&& node : nodes) {
+            for (auto&& trans : node->transitions) {
+                if (trans.characters.contains(chars)) {
+                    dest.push_back(trans.next);
+                }
+            }
+        }
+    }
+
+    /**
+     * Computes the epsilon-closure of a set of NFA states i.e. all states
+     * reachable from them following only epsilon transitions. The result is
+     * sorted, so that equal sets of states compare and hash equally.
+     */
+    template <typename CharType, typename TokenInfo, typename T>
+    void eclosure(
+        std::vector<const nfa_node<CharType, TokenInfo>*>& dest,
+        const T& nodes,
+        std::unordered_set<const nfa_node<CharType, TokenInfo>*>& visited
+    ) {
+        visited.clear();
+
+        for (auto&& node : nodes) {
+            if (visited.insert(node).second)
+                dest.push_back(node);
+        }
+
+        for (size_t i = 0; i < dest.size(); ++i) {
+            for (auto&& trans : dest[i]->transitions) {
+                if (trans.epsilon && visited.insert(trans.next).second) {
+                    dest.push_back(trans.next);
+                }
+            }
+        }
+
+        std::sort(dest.begin(), dest.end());
+    }
+
+    /**
+     * Takes a collection of interval sets and splits their union into disjoint
+     * intervals corresponding to all
+     * possible intersections between collections, in increasing order.
+     */
+    template <typename CharType, typename T>
+    void make_disjoint(std::vector<typename range_set<CharType>::interval>& dest, const T& nodes) {
+        std::vector<std::pair<bool, CharType>> vec;
+        for (auto&& node : nodes) {
+            for (auto&& trans : node->transitions) {
+                for (auto&& inter : trans.characters) {
+                    vec.push_back({ true, inter.lower });
+                    vec.push_back({ false, inter.upper });
+                }
+            }
+        }
+        sort(vec.begin(), vec.end(), [](std::pair<bool, CharType> a, std::pair<bool, CharType> b) {
+            return a.second < b.second || ((a.second == b.second) && (a.first && !b.first));
+        });
+
+        int depth = 0;
+        std::pair<bool, CharType> last;
+
+        for (auto current : vec) {
+            if (depth != 0) {
+                // Wide enough for the bounds of any character type not to wrap
+                // around.
+                auto lower = static_cast<int64_t>(last.second) + (last.first ? 0 : 1);
+                auto upper = static_cast<int64_t>(current.second) - (current.first ? 1 : 0);
+
+                if (lower <= upper) {
+                    dest.push_back({ static_cast<CharType>(lower), static_cast<CharType>(upper) });
+                }
+            }
+
+            last = current;
+
+            if (current.first) {
+                depth++;
+            }
+            if (!current.first) {
+                depth--;
+            }
+        }
+    }
+
+    /**
+     * Transition of a DFA state computed by the subset construction, on the
+     * closed interval [lower, upper] to the (sorted) set of NFA states next.
+     */
+    template <typename CharType, typename TokenInfo>
+    struct dfa_step {
+        CharType lower;
+        CharType upper;
+        std::vector<const nfa_node<CharType, TokenInfo>*> next;
+    };
+
+    /**
+     * Transitions of DFA states by their set of NFA states, kept between subset
+     * constructions over NFAs that share fragments (e.g. the automata of the
+     * individual productions of a grammar that is being edited). Only sets of
+     * states of registered fragments are cached; when a fragment is removed,
+     * all the entries involving its states are dropped.
+     */
+    template <typename CharType, typename TokenInfo>
+    class dfa_cache {
+      public:
+        using nfa_node_type = nfa_node<CharType, TokenInfo>;
+        using key_type = std::vector<const nfa_node_type*>;
+        using step_type = dfa_step<CharType, TokenInfo>;
+
+      private:
+        struct key_hash {
+            size_t operator()(const key_type& x) const {
+                size_t hash = 2166136261;
+                for (auto&& part : x)
+                    hash = hash * 16777619 ^ reinterpret_cast<size_t>(part);
+                return hash;
+            }
+        };
+
+        std::unordered_map<key_type, std::vector<step_type>, key_hash> _steps;
+        std::unordered_set<const nfa_node_type*> _stable;
+
+        static std::vector<const nfa_node_type*> reachable(const nfa_node_type& root) {
+            std::vector<const nfa_node_type*> nodes{ &root };
+            std::unordered_set<const nfa_node_type*> visited{ &root };
+            for (size_t i = 0; i < nodes.size(); ++i) {
+                for (auto&& transition : nodes[i]->transitions) {
+                    if (visited.insert(transition.next).second)
+                        nodes.push_back(transition.next);
+                }
+            }
+            return nodes;
+        }
+
+      public:
+        void add_fragment(const nfa_node_type& root) {
+            for (auto&& node : reachable(root))
+                _stable.insert(node);
+        }
+
+        void remove_fragment(const nfa_node_type& root) {
+            auto nodes = reachable(root);
+            for (auto&& node : nodes)
+                _stable.erase(node);
+
+            std::unordered_set<const nfa_node_type*> removed(nodes.begin(), nodes.end());
+            for (auto it = _steps.begin(); it != _steps.end();) {
+                bool stale = false;
+                for (auto&& node : it->first)
+                    stale = stale || removed.count(node) != 0;
+                it = stale ? _steps.erase(it) : std::next(it);
+            }
+        }
+
+        /**
+         * Whether the transitions of the set of NFA states can be cached, i.e.
+         * all of them belong to registered fragments.
+         */
+        bool cacheable(const key_type& nodes) const {
+            for (auto&& node : nodes) {
+                if (_stable.count(node) == 0)
+                    return false;
+            }
+            return true;
+        }
+
+        const std::vector<step_type>* find(const key_type& nodes) const {
+            auto it = _steps.find(nodes);
+            return it == _steps.end() ? nullptr : &it->second;
+        }
+
+        const std::vector<step_type>& insert(const key_type& nodes, std::vector<step_type> steps) {
+            return _steps.emplace(nodes, std::move(steps)).first->second;
+        }
+
+        size_t size() const {
+            return _steps.size();
+        }
+    };
+
+    template <typename CharType, typename TokenInfo>
+    class dfa {
+      public:
+        using node_type = dfa_node<CharType, TokenInfo>;
+        using nfa_node_type = nfa_node<CharType, TokenInfo>;
+        using set_type = std::unordered_set<dfa_node<CharType, TokenInfo>*>;
+
+      private:
+        set_type _nodes;
+        std::vector<node_type*> _initials;
+
+        dfa(const dfa& other) = delete;
+        dfa& operator=(const dfa&) = delete;
+
+        struct dfa_node_hash {
+            size_t operator()(node_type* x) const {
+                size_t hash = 2166136261;
+                for (auto&& part : x->nodes)
+                    hash = hash * 16777619 ^ reinterpret_cast<size_t>(part);
+                return hash;
+            }
+        };
+
+        struct dfa_node_eq {
+            bool operator()(node_type* x, node_type* y) const {
+                return x->nodes == y->nodes;
+            }
+        };
+
+        /* Merges adjacent transitions leading to the same state. */
+        static void coalesce(node_type* node) {
+            auto& transitions = node->transitions;
+            size_t size = 0;
+
+            for (size_t i = 0; i < transitions.size(); ++i) {
+                if (size != 0 && transitions[size - 1].next == transitions[i].next &&
+                    transitions[size - 1].upper + 1 == transitions[i].lower) {
+                    transitions[size - 1].upper = transitions[i].upper;
+                } else {
+                    transitions[size++] = transitions[i];
+                }
+            }
+
+            transitions.erase(transitions.begin() + size, transitions.end());
+        }
+
+      public:
+        /**
+         * Subset construction from the start state of an NFA. If a cache is
+         * given, the transitions of sets of NFA states found in it are reused
+         * rather than computed, and the computed ones are added to it.
+         */
+        dfa(const nfa_node_type& start, dfa_cache<CharType, TokenInfo>* cache = nullptr)
+          : dfa(std::vector<const nfa_node_type*>{ &start }, cache) {
+        }
+
+        /**
+         * Subset construction from the start states of several modes at once,
+         * so that the modes share the DFA states with the same set of NFA
+         * states.
+         */
+        dfa(
+            const std::vector<const nfa_node_type*>& starts,
+            dfa_cache<CharType, TokenInfo>* cache = nullptr
+        ) {
+            std::vector<node_type*> unmarked;
+            std::unordered_set<node_type*, dfa_node_hash, dfa_node_eq> result;
+            std::unordered_set<const nfa_node_type*> visited;
+            std::vector<const nfa_node_type*> moved;
+            std::vector<typename range_set<CharType>::interval> letters;
+            std::vector<dfa_step<CharType, TokenInfo>> computed;
+
+            for (auto&& start : starts) {
+                auto initial = new node_type();
+                std::initializer_list<const nfa_node_type*> start_nodes{ start };
+                eclosure(initial->nodes, start_nodes, visited);
+
+                auto status = result.insert(initial);
+                if (status.second)
+                    unmarked.push_back(initial);
+                else
+                    delete initial;
+                _initials.push_back(*status.first);
+            }
+
+            while (!unmarked.empty()) {
+                auto D = unmarked.back();
+                unmarked.pop_back();
+
+                auto steps = cache != nullptr ? cache->find(D->nodes) : nullptr;
+                if (steps == nullptr) {
+                    letters.clear();
+                    make_disjoint<CharType>(letters, D->nodes);
+
+                    computed.clear();
+                    for (auto&& inter : letters) {
+                        moved.clear();
+                        move_s(moved, D->nodes, inter);
+                        computed.push_back({ inter.lower, inter.upper, {} });
+                        eclosure(computed.back().next, moved, visited);
+                        if (computed.back().next.empty())
+                            computed.pop_back();
+                    }
+
+                    steps = &computed;
+                    if (cache != nullptr && cache->cacheable(D->nodes))
+                        steps = &cache->insert(D->nodes, computed);
+                }
+
+                for (auto&& step : *steps) {
+                    auto new_node = new node_type(step.next);
+                    auto status = result.emplace(new_node);
+                    if (status.second)
+                        unmarked.push_back(new_node);
+                    else
+                        delete new_node;
+
+                    D->transitions.emplace_back(step.lower, step.upper, *status.first);
+                }
+            }
+
+            _nodes = set_type(result.begin(), result.end());
+            result.clear();
+
+            for (auto&& node : _nodes) {
+                node->freeze();
+                coalesce(node);
+            }
+        }
+
+        /**
+         * Moore's algorithm for DFA state minimization. Identifies all the
+         * indistinguishable subsets of
+         * DFA states and replaces them with a single state.
+         */
+        void optimize() {
+            // Compilers: Principles, Techniques and Tools SE, page 182
+            std::vector<node_type*> states(_nodes.begin(), _nodes.end());
+            std::unordered_map<const node_type*, size_t> index;
+            for (size_t i = 0; i < states.size(); ++i)
+                index.emplace(states[i], i);
+
+            // Create the initial partition - non-accepting states and the accepting
+            // states grouped by the token they emit.
+            std::vector<size_t> block(states.size());
+            std::map<TokenInfo, size_t> tokens;
+            bool rejecting = false;
+
+            for (size_t i = 0; i < states.size(); ++i) {
+                if (states[i]->terminal()) {
+                    auto status = tokens.emplace(states[i]->get_terminal(), tokens.size() + 1);
+                    block[i] = status.first->second;
+                } else {
+                    block[i] = 0;
+                    rejecting = true;
+                }
+            }
+
+            // Only count the blocks that are not empty, or the first refinement
+            // could be taken for a stable one.
+            size_t blocks = tokens.size() + rejecting;
+
+            // Refine partitions until there are no more changes. Two states stay in
+            // the same block if they were in the same block before and for each
+            // input symbol their transitions lead to the same block.
+            struct signature_hash {
+                size_t operator()(const std::vector<size_t>& x) const {
+                    size_t hash = 2166136261;
+                    for (auto&& part : x)
+                        hash = hash * 16777619 ^ part;
+                    return hash;
+                }
+            };
+
+            std::unordered_map<std::vector<size_t>, size_t, signature_hash> signatures;
+            std::vector<size_t> new_block(states.size());
+            std::vector<size_t> signature;
+
+            while (true) {
+                signatures.clear();
+
+                for (size_t i = 0; i < states.size(); ++i) {
+                    signature.clear();
+                    signature.push_back(block[i]);
+                    for (auto&& transition : states[i]->transitions) {
+                        auto target = block[index.at(transition.next)];
+                        auto lower = static_cast<size_t>(transition.lower);
+                        auto upper = static_cast<size_t>(transition.upper);
+
+                        // Adjacent intervals leading to the same block are merged, so
+                        // that the signature does not depend on how they were split.
+                        auto size = signature.size();
+                        if (size > 1 && signature[size - 1] == target &&
+                            signature[size - 2] + 1 == lower) {
+                            signature[size - 2] = upper;
+                        } else {
+                            signature.push_back(lower);
+                            signature.push_back(upper);
+                            signature.push_back(target);
+                        }
+                    }
+                    new_block[i] = signatures.emplace(signature, signatures.size()).first->second;
+                }
+
+                bool stable = signatures.size() == blocks;
+                blocks = signatures.size();
+                block.swap(new_block);
+                if (stable)
+                    break;
+            }
+
+            std::vector<node_type*> representative(blocks, nullptr);
+            for (size_t i = 0; i < states.size(); ++i) {
+                if (representative[block[i]] == nullptr)
+                    representative[block[i]] = states[i];
+            }
+
+            for (auto& node : representative) {
+                for (auto& transition : node->transitions)
+                    transition.next = representative[block[index.at(transition.next)]];
+                coalesce(node);
+            }
+
+            for (auto&& initial : _initials)
+                initial = representative[block[index.at(initial)]];
+
+            for (size_t i = 0; i < states.size(); ++i) {
+                if (representative[block[i]] != states[i]) {
+                    _nodes.erase(states[i]);
+                    delete states[i];
+                }
+            }
+        }
+
+        const node_type* start() const {
+            return _initials.front();
+        }
+
+        /* Start states by mode, possibly the same for several modes. */
+        const std::vector<node_type*>& starts() const {
+            return _initials;
+        }
+
+        const set_type& states() const {
+            return _nodes;
+        }
+
+        ~dfa() {
+            for (auto node : _nodes)
+                delete node;
+        }
+    };
+
+    template <typename AdditionalInfo>
+    struct basic_token_info {
+        int precedence;
+        AdditionalInfo additional_info;
+
+        friend bool operator<(const basic_token_info& lhs, const basic_token_info& rhs) {
+            return (lhs.precedence < rhs.precedence);
+        }
+
+        friend bool operator==(const basic_token_info& lhs1, const basic_token_info& rhs1) {
+            return lhs1.precedence == rhs1.precedence;
+        }
+
+        friend bool operator!=(const basic_token_info& lhs1, const basic_token_info& rhs1) {
+            return !(lhs1 == rhs1);
+        }
+    };
+
+    /**
+     * Minimal perfect hash table of keywords that are not part of the automaton.
+     * They are recognized by a more general production (e.g. an identifier) and
+     * reclassified when that production is accepted: a token accepted in a state
+     * with the `keywords` flag set is looked up with find() and, if found,
+     * emitted as the keyword instead.
+     *
+     * The slot of a word is hash(seeds[hash(0, word) % seeds.size()], word) %
+     * slots.size(), so code generators can reproduce the lookup with constant
+     * tables.
+     */
+    template <typename CharType, typename AdditionalInfo>
+    struct keyword_table {
+        std::vector<std::basic_string<CharType>> words;
+        std::vector<int> productions;
+        std::vector<AdditionalInfo> infos;
+
+        std::vector<uint32_t> seeds;
+        std::vector<int> slots;
+
+        template <typename Iterator>
+        static uint32_t hash(uint32_t seed, Iterator begin, Iterator end) {
+            uint32_t hash = 2166136261u ^ seed;
+            for (; begin != end; ++begin)
+                hash = (hash ^ static_cast<uint32_t>(*begin)) * 16777619u;
+            hash ^= hash >> 16;
+            hash *= 0x85ebca6bu;
+            hash ^= hash >> 13;
+            hash *= 0xc2b2ae35u;
+            hash ^= hash >> 16;
+            return hash;
+        }
+
+        void add(const std::basic_string<CharType>& word, int production, AdditionalInfo info) {
+            words.push_back(word);
+            productions.push_back(production);
+            infos.push_back(info);
+        }
+
+        /**
+         * Computes the perfect hash function using hash and displace: words are
+         * distributed into buckets and, starting with the largest bucket, a seed
+         * is searched for each bucket that places all its words into free slots.
+         * The words have to be distinct; throws if they cannot be placed.
+         */
+        void build() {
+            seeds.clear();
+            slots.clear();
+            if (words.empty())
+                return;
+
+            // Distinct words are placed well before the table gets this sparse.
+            size_t limit = 16 * words.size() + 16;
+            for (size_t size = words.size() + words.size() / 4 + 1; size <= limit; size *= 2) {
+                seeds.assign(words.size() / 2 + 1, 0);
+                slots.assign(size, -1);
+
+                std::vector<std::vector<int>> buckets(seeds.size());
+                for (size_t i = 0; i < words.size(); ++i) {
+                    auto bucket = hash(0, words[i].begin(), words[i].end()) % seeds.size();
+                    buckets[bucket].push_back(static_cast<int>(i));
+                }
+
+                std::vector<size_t> order(buckets.size());
+                for (size_t i = 0; i < order.size(); ++i)
+                    order[i] = i;
+                std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+                    return buckets[a].size() > buckets[b].size();
+                });
+
+                bool success = true;
+                std::vector<size_t> taken;
+
+                for (auto&& bucket : order) {
+                    if (buckets[bucket].empty())
+                        break;
+
+                    bool placed = false;
+                    for (uint32_t seed = 1; seed < (1u << 16) && !placed; ++seed) {
+                        taken.clear();
+                        placed = true;
+                        for (auto&& word : buckets[bucket]) {
+                            auto slot = hash(seed, words[word].begin(), words[word].end()) % size;
+                            if (slots[slot] != -1 ||
+                                std::find(taken.begin(), taken.end(), slot) != taken.end()) {
+                                placed = false;
+                                break;
+                            }
+                            taken.push_back(slot);
+                        }
+                        if (placed) {
+                            seeds[bucket] = seed;
+                            for (size_t i = 0; i < taken.size(); ++i)
+                                slots[taken[i]] = buckets[bucket][i];
+                        }
+                    }
+
+                    if (!placed) {
+                        success = false;
+                        break;
+                    }
+                }
+
+                if (success)
+                    return;
+            }
+
+            throw std::runtime_error("Cannot build the keyword table.");
+        }
+
+        /**
+         * Returns the index of the keyword equal to the given word, or -1.
+         */
+        template <typename Iterator>
+        int find(Iterator begin, Iterator end) const {
+            if (slots.empty())
+                return -1;
+            auto seed = seeds[hash(0, begin, end) % seeds.size()];
+            auto index = slots[hash(seed, begin, end) % slots.size()];
+            if (index == -1 ||
+                static_cast<size_t>(std::distance(begin, end)) != words[index].size() ||
+                !std::equal(begin, end, words[index].begin()))
+                return -1;
+            return index;
+        }
+
+        bool empty() const {
+            return words.empty();
+        }
+    };
+
+    template <typename CharType, typename AdditionalInfo>
+    struct lexer_transition {
+        boost::icl::interval_set<CharType> characters;
+        size_t next;
+
+        explicit lexer_transition(size_t next_) : next(next_) {
+        }
+        lexer_transition(boost::icl::interval_set<CharType> characters_, size_t next_)
+          : characters(characters_), next(next_) {
+        }
+    };
+
+    template <typename CharType, typename AdditionalInfo>
+    struct lexer_node {
+        std::vector<lexer_transition<CharType, AdditionalInfo>> transitions;
+
+        bool terminal;
+        AdditionalInfo terminal_info;
+        int production;
+        bool keywords;
+
+        lexer_node() : terminal(false), terminal_info(), production(-1), keywords(false) {
+        }
+
+        lexer_node(const dfa_node<CharType, basic_token_info<AdditionalInfo>>& node)
+          : terminal(node.terminal()),
+            terminal_info(node.get_terminal().additional_info),
+            production(node.terminal() ? node.get_terminal().precedence : -1),
+            keywords(false) {
+        }
+    };
+
+    /**
+     * Number of times each state of a lexer was entered and each of its
+     * transitions was taken while tokenizing a sample corpus, indexed like
+     * lexer::states(). Passed to lexer_generator::generate() to lay the lexer
+     * out for that workload.
+     */
+    struct lexer_profile {
+        std::vector<uint64_t> visits;
+        std::vector<std::vector<uint64_t>> transitions;
+
+        void save(std::ostream& out) const {
+            out << "supercomplex-profile 1" << std::endl << visits.size() << std::endl;
+            for (size_t i = 0; i < visits.size(); ++i) {
+                out << visits[i] << " " << transitions[i].size();
+                for (auto&& count : transitions[i])
+                    out << " " << count;
+                out << std::endl;
+            }
+        }
+
+        void load(std::istream& in) {
+            std::string magic;
+            int version = 0;
+            size_t size = 0;
+            in >> magic >> version >> size;
+            if (!in || magic != "supercomplex-profile" || version != 1)
+                throw std::runtime_error("Invalid lexer profile.");
+
+            visits.assign(size, 0);
+            transitions.assign(size, {});
+            for (size_t i = 0; i < size; ++i) {
+                size_t count = 0;
+                in >> visits[i] >> count;
+                transitions[i].assign(count, 0);
+                for (auto&& transition : transitions[i])
+                    in >> transition;
+            }
+            if (!in)
+                throw std::runtime_error("Invalid lexer profile.");
+        }
+    };
+
+    /**
+     * Line and column (both starting at 1, the column counted in characters)
+     * of a position in the input.
+     */
+    struct text_location {
+        size_t line;
+        size_t column;
+
+        text_location() : line(1), column(1) {
+        }
+    };
+
+    /**
+     * Returns the first '\n' in [begin, end), or end if there is none. Single
+     * byte characters are compared 16 at a time with SSE2, or 8 at a time
+     * within a 64-bit word without it.
+     */
+    template <typename CharType>
+    const CharType* find_newline(const CharType* begin, const CharType* end) {
+        if (sizeof(CharType) == 1) {
+#if defined(__SSE2__)
+            const __m128i newlines = _mm_set1_epi8('\n');
+            for (; end - begin >= 16; begin += 16) {
+                auto block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(block, newlines)) != 0)
+                    break;
+            }
+#else
+            for (; end - begin >= 8; begin += 8) {
+                // The high bit of a byte of matches is set iff the byte is '\n'.
+                uint64_t word;
+                std::memcpy(&word, begin, 8);
+                word ^= 0x0a0a0a0a0a0a0a0aull;
+                auto matches = ~(((word & 0x7f7f7f7f7f7f7f7full) + 0x7f7f7f7f7f7f7f7full) | word |
+                                 0x7f7f7f7f7f7f7f7full);
+                if (matches != 0)
+                    break;
+            }
+#endif
+        }
+        while (begin != end && *begin != static_cast<CharType>('\n'))
+            ++begin;
+        return begin;
+    }
+
+    /**
+     * Returns the number of '\n' in [begin, end), see find_newline().
+     */
+    template <typename CharType>
+    size_t count_newlines(const CharType* begin, const CharType* end) {
+        size_t count = 0;
+        if (sizeof(CharType) == 1) {
+#if defined(__SSE2__)
+            const __m128i newlines = _mm_set1_epi8('\n');
+            for (; end - begin >= 16; begin += 16) {
+                auto block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+                auto mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newlines));
+                count += std::bitset<16>(static_cast<unsigned>(mask)).count();
+            }
+#else
+            for (; end - begin >= 8; begin += 8) {
+                uint64_t word;
+                std::memcpy(&word, begin, 8);
+                word ^= 0x0a0a0a0a0a0a0a0aull;
+                auto matches = ~(((word & 0x7f7f7f7f7f7f7f7full) + 0x7f7f7f7f7f7f7f7full) | word |
+                                 0x7f7f7f7f7f7f7f7full);
+                count += std::bitset<64>(matches).count();
+            }
+#endif
+        }
+        for (; begin != end; ++begin)
+            count += *begin == static_cast<CharType>('\n');
+        return count;
+    }
+
+    /**
+     * Returns the location after [begin, end) if begin is at the location, so
+     * that the location of consecutive tokens can be tracked by counting the
+     * newlines in each of them, rather than checking every character while
+     * scanning.
+     */
+    template <typename CharType>
+    text_location advance(text_location location, const CharType* begin, const CharType* end) {
+        auto lines = count_newlines(begin, end);
+        if (lines == 0) {
+            location.column += static_cast<size_t>(end - begin);
+            return location;
+        }
+
+        auto last = end;
+        while (*(last - 1) != static_cast<CharType>('\n'))
+            --last;
+        location.line += lines;
+        location.column = static_cast<size_t>(end - last) + 1;
+        return location;
+    }
+
+    /**
+     * Offsets at which the lines of the input start, built incrementally as
+     * the input is appended (e.g. along with lexer_stream::feed() or between
+     * calls to lexer::tokenize()), which gives the location of any offset in
+     * logarithmic time without tracking it during scanning.
+     */
+    template <typename CharType>
+    class line_index {
+        std::vector<size_t> _starts;
+        size_t _size;
+
+      public:
+        line_index() : _starts(1, 0), _size(0) {
+        }
+
+        /**
+         * Appends the next size characters of the input.
+         */
+        void extend(const CharType* data, size_t size) {
+            auto end = data + size;
+            for (auto position = find_newline(data, end); position != end;
+                 position = find_newline(position + 1, end)) {
+                _starts.push_back(_size + static_cast<size_t>(position - data) + 1);
+            }
+            _size += size;
+        }
+
+        /**
+         * Location of the character at the offset, which may be at most size().
+         */
+        text_location locate(size_t offset) const {
+            if (offset > _size)
+                throw std::out_of_range("Offset is past the indexed input.");
+
+            auto line = std::upper_bound(_starts.begin(), _starts.end(), offset) - 1;
+            text_location location;
+            location.line = static_cast<size_t>(line - _starts.begin()) + 1;
+            location.column = offset - *line + 1;
+            return location;
+        }
+
+        size_t lines() const {
+            return _starts.size();
+        }
+
+        size_t size() const {
+            return _size;
+        }
+    };
+
+    constexpr uint64_t token_hash_basis = 14695981039346656037ull;
+
+    /**
+     * One step of the 64-bit FNV-1a hash of a token, which lexer::match() and
+     * lexer::tokenize() can compute while scanning. Characters are hashed as
+     * unsigned code points, so generated lexers can reproduce the hash.
+     */
+    template <typename CharType>
+    uint64_t token_hash_step(uint64_t hash, CharType ch) {
+        using code_point = typename std::make_unsigned<CharType>::type;
+        return (hash ^ static_cast<code_point>(ch)) * 1099511628211ull;
+    }
+
+    template <typename Iterator>
+    uint64_t token_hash(Iterator begin, Iterator end) {
+        uint64_t hash = token_hash_basis;
+        for (; begin != end; ++begin)
+            hash = token_hash_step(hash, *begin);
+        return hash;
+    }
+
+    /**
+     * Interns strings (such as identifiers) as dense ids. The characters are
+     * copied into blocks that are never moved, so text() stays valid for the
+     * lifetime of the table. With the hash of the token computed by the lexer,
+     * intern() only reads the characters again to compare them with a symbol
+     * of the same hash.
+     */
+    template <typename CharType>
+    class symbol_table {
+        static constexpr size_t block_size = 16384;
+
+        struct symbol {
+            const CharType* text;
+            size_t length;
+            uint64_t hash;
+        };
+
+        std::vector<std::unique_ptr<CharType[]>> _blocks;
+        size_t _used;
+        size_t _capacity;
+
+        std::vector<symbol> _symbols;
+
+        /* Open addressing table of symbol ids + 1, 0 for an empty slot. */
+        std::vector<uint32_t> _slots;
+
+        const CharType* store(const CharType* text, size_t length) {
+            // Empty strings need a block too, the first one included. The
+            // block size is copied so that it is not odr-used before C++17.
+            if (_blocks.empty() || _used + length > _capacity) {
+                _capacity = std::max(static_cast<size_t>(block_size), length);
+                _blocks.emplace_back(new CharType[_capacity]);
+                _used = 0;
+            }
+            auto result = _blocks.back().get() + _used;
+            std::copy(text, text + length, result);
+            _used += length;
+            return result;
+        }
+
+        void rehash() {
+            std::vector<uint32_t> slots(std::max<size_t>(64, _slots.size() * 2), 0);
+            size_t mask = slots.size() - 1;
+            for (size_t id = 0; id < _symbols.size(); ++id) {
+                auto i = static_cast<size_t>(_symbols[id].hash) & mask;
+                while (slots[i] != 0)
+                    i = (i + 1) & mask;
+                slots[i] = static_cast<uint32_t>(id + 1);
+            }
+            _slots.swap(slots);
+        }
+
+      public:
+        symbol_table() : _used(0), _capacity(0) {
+        }
+
+        /**
+         * Returns the id of the string, adding it if it is not in the table yet.
+         * The hash has to be token_hash() of the string.
+         */
+        uint32_t intern(const CharType* text, size_t length, uint64_t hash) {
+            if ((_symbols.size() + 1) * 2 > _slots.size())
+                rehash();
+
+            size_t mask = _slots.size() - 1;
+            for (auto i = static_cast<size_t>(hash) & mask;; i = (i + 1) & mask) {
+                if (_slots[i] == 0) {
+                    auto id = static_cast<uint32_t>(_symbols.size());
+                    _symbols.push_back({ store(text, length), length, hash });
+                    _slots[i] = id + 1;
+                    return id;
+                }
+
+                const auto& existing = _symbols[_slots[i] - 1];
+                if (existing.hash == hash && existing.length == length &&
+                    std::equal(text, text + length, existing.text))
+                    return _slots[i] - 1;
+            }
+        }
+
+        uint32_t intern(const CharType* text, size_t length) {
+            return intern(text, length, token_hash(text, text + length));
+        }
+
+        const CharType* text(uint32_t id) const {
+            return _symbols[id].text;
+        }
+
+        size_t length(uint32_t id) const {
+            return _symbols[id].length;
+        }
+
+        size_t size() const {
+            return _symbols.size();
+        }
+    };
+
+    /**
+     * Position in the input from which lexer::tokenize() continues, and the
+     * mode in which it matches tokens (see lexer_production::modes), which the
+     * caller may change between calls.
+     */
+    struct lexer_cursor {
+        size_t position;
+        size_t mode;
+        bool failed;
+
+        lexer_cursor() : position(0), mode(0), failed(false) {
+        }
+    };
+
+    /**
+     * One of many independent inputs tokenized together by lexer::tokenize(),
+     * with the same meaning of the fields as the arguments of the single input
+     * version. The number of tokens written is stored in count.
+     */
+    template <typename CharType>
+    struct lexer_input {
+        const CharType* data;
+        size_t size;
+        lexer_cursor cursor;
+
+        int* productions;
+        size_t* offsets;
+        size_t* lengths;
+        size_t capacity;
+        size_t count;
+    };
+
+    /**
+     * Mapping of characters to character classes of a lexer. Code points below
+     * 256 are looked up directly. Above that (for wide characters), a
+     * three-stage trie takes the code point apart into 10 + 5 + 5 bits: index
+     * gives the block of blocks, which gives the block of data holding the
+     * class. Identical blocks are stored once, so large ranges of code points
+     * (such as Unicode categories) take a few KB. Code points past the Unicode
+     * range are found by binary search among the segments of code points with
+     * the same class, which are sorted in the order of the unsigned code point.
+     */
+    template <typename CharType>
+    struct character_classes {
+        using code_point = typename std::make_unsigned<CharType>::type;
+
+        static constexpr uint32_t trie_limit = 0x110000;
+
+        std::vector<uint16_t> latin;
+        std::vector<uint16_t> index;
+        std::vector<uint32_t> blocks;
+        std::vector<uint16_t> data;
+        uint32_t limit;
+
+        std::vector<code_point> lowers;
+        std::vector<uint16_t> classes;
+        size_t count;
+
+        character_classes() : limit(0), count(0) {
+        }
+
+        uint16_t find(CharType ch) const {
+            auto cp = static_cast<uint32_t>(static_cast<code_point>(ch));
+            if (cp < 256)
+                return latin[cp];
+            if (cp < limit)
+                return data[blocks[index[cp >> 10] + ((cp >> 5) & 31)] + (cp & 31)];
+            auto segment = std::upper_bound(lowers.begin(), lowers.end(), cp) - lowers.begin();
+            return classes[static_cast<size_t>(segment) - 1];
+        }
+
+        /**
+         * Builds the tables from segments of code points: the class of code
+         * points from lowers_[i] up to lowers_[i + 1] is classes_[i], and
+         * lowers_[0] is 0.
+         */
+        void build(std::vector<code_point> lowers_, std::vector<uint16_t> classes_, size_t count_) {
+            lowers = std::move(lowers_);
+            classes = std::move(classes_);
+            count = count_;
+
+            size_t segment = 0;
+            auto class_of = [&](uint32_t cp) {
+                while (segment + 1 < lowers.size() && lowers[segment + 1] <= cp)
+                    ++segment;
+                return classes[segment];
+            };
+            // Whether [cp, cp + size) is within a single segment.
+            auto uniform = [&](uint32_t cp, uint32_t size) {
+                class_of(cp);
+                return segment + 1 == lowers.size() || lowers[segment + 1] >= cp + size;
+            };
+
+            uint64_t code_points = uint64_t(std::numeric_limits<code_point>::max()) + 1;
+            latin.resize(static_cast<size_t>(std::min<uint64_t>(code_points, 256)));
+            for (uint32_t cp = 0; cp < latin.size(); ++cp)
+                latin[cp] = class_of(cp);
+
+            limit = static_cast<uint32_t>(std::min<uint64_t>(code_points, trie_limit));
+            if (limit <= 256)
+                return;
+
+            std::map<std::vector<uint16_t>, uint32_t> data_blocks;
+            std::map<std::vector<uint32_t>, uint16_t> index_blocks;
+            std::vector<uint16_t> values(32);
+            std::vector<uint32_t> block(32);
+
+            for (uint32_t top = 0; top < limit; top += 1024) {
+                for (uint32_t i = 0; i < 32; ++i) {
+                    auto first = top + 32 * i;
+                    if (uniform(first, 32)) {
+                        std::fill(values.begin(), values.end(), class_of(first));
+                    } else {
+                        for (uint32_t j = 0; j < 32; ++j)
+                            values[j] = class_of(first + j);
+                    }
+                    auto status = data_blocks.emplace(values, static_cast<uint32_t>(data.size()));
+                    if (status.second)
+                        data.insert(data.end(), values.begin(), values.end());
+                    block[i] = status.first->second;
+                }
+                auto status = index_blocks.emplace(block, static_cast<uint16_t>(blocks.size()));
+                if (status.second)
+                    blocks.insert(blocks.end(), block.begin(), block.end());
+                index.push_back(status.first->second);
+            }
+        }
+    };
+
+    /**
+     * How the transitions of a state are stored in the class table of a lexer:
+     * a row with the next state for every character class, a sorted list of
+     * the classes with a transition and their next states, a bitmap of the
+     * classes with a transition to the most common next state (with a short
+     * list of the other transitions, like the one continuing a keyword in a
+     * state that otherwise continues an identifier), or the only class with a
+     * transition.
+     */
+    enum class transition_encoding : uint8_t { dense, sparse, bitmap, single };
+
+    template <typename CharType, typename AdditionalInfo>
+    class lexer {
+        using lexer_node_type = lexer_node<CharType, AdditionalInfo>;
+        using keyword_table_type = keyword_table<CharType, AdditionalInfo>;
+        std::vector<lexer_node_type> _states;
+        std::vector<int> _starts;
+        keyword_table_type _keywords;
+
+        struct range {
+            CharType lower;
+            CharType upper;
+            int next;
+        };
+
+        /* Transitions of all the states as ranges sorted by character, the ones
+         * of state i are [_offsets[i], _offsets[i + 1]). */
+        std::vector<range> _ranges;
+        std::vector<size_t> _offsets;
+
+        /* The transitions are also kept by character class, where characters
+         * are in the same class if every state has the same transition on them,
+         * with the encoding that suits each state (see compile_rows()).
+         *
+         * Scanning follows row ids rather than states: the id of a state with a
+         * dense row is twice the row's offset in _dense (where the state itself
+         * precedes the row), the one of a state with another encoding is the
+         * complement of twice the index of the encoding in _encoded, and the
+         * lowest bit is set if the state is accepting. The transitions lead to
+         * row ids, so a step takes no multiplication and no lookup of the next
+         * state's row. Missing transitions lead to
+         * dead_row, and the transitions on NUL, which has a class of its own,
+         * to terminator_row, their next states are kept in _terminators. This
+         * way match_terminated() only checks for the end of the input in the
+         * states that can consume NUL. */
+        character_classes<CharType> _classes;
+
+        static constexpr int dead_row = std::numeric_limits<int>::max() - 1;
+        static constexpr int terminator_row = std::numeric_limits<int>::max();
+
+        /* The encoding of a state's transitions: the sorted list of the sparse
+         * ones (or the exceptions to the bitmap) is [entries, entries + size)
+         * in _sparse, and the dense row starts at offset in _dense. The first
+         * 64 classes of the bitmap are kept in bits, so that lexers with few
+         * classes look nothing else up, the others at offset in _bitmaps. */
+        struct row {
+            transition_encoding encoding;
+            uint16_t character_class;
+            uint32_t size;
+            uint32_t entries;
+            uint32_t offset;
+            int next;
+            int state;
+            uint64_t bits;
+        };
+
+        struct sparse_entry {
+            uint16_t character_class;
+            int next;
+        };
+
+        std::vector<int> _ids;
+        std::vector<row> _encoded;
+        std::vector<int> _dense;
+        std::vector<sparse_entry> _sparse;
+        std::vector<uint64_t> _bitmaps;
+        std::vector<int> _terminators;
+
+        /* Whether each state is accepting, kept apart from the nodes so that the
+         * scanning loops touch as little memory as possible. */
+        std::vector<char> _accepting;
+
+        /* Dense table of the transitions indexed by state and character class,
+         * with the transitions of the start state of mode 0 folded into the missing
+         * transitions of accepting states: entry (next << 1) | 1 means that the
+         * state's token ends before the character and the next one continues
+         * in state next. Used by the multiple input tokenize(). */
+        std::vector<int> _fused;
+
+        /* Length of the longest token at the beginning of the input scanned
+         * from the start state and the state accepting it. */
+        template <typename Iterator>
+        size_t longest(int start, Iterator begin, Iterator end, int& accepted) const {
+            uint64_t hash;
+            return longest<false>(start, begin, end, accepted, hash);
+        }
+
+        /* With hashed set, also computes the token_hash() of the token. */
+        template <bool hashed, typename Iterator>
+        size_t longest(
+            int start,
+            Iterator begin,
+            Iterator end,
+            int& accepted,
+            uint64_t& hash
+        ) const {
+            size_t length = 0;
+            size_t consumed = 0;
+            uint64_t running = token_hash_basis;
+            accepted = -1;
+
+            if (_ids.empty()) {
+                int state = start;
+                for (auto position = begin; position != end; ++position) {
+                    if ((state = search(state, *position)) == -1)
+                        break;
+                    ++consumed;
+                    if (hashed)
+                        running = token_hash_step(running, *position);
+                    if (_accepting[state]) {
+                        accepted = state;
+                        length = consumed;
+                        if (hashed)
+                            hash = running;
+                    }
+                }
+                return length;
+            }
+
+            int id = _ids[static_cast<size_t>(start)];
+            int accepted_id = id;
+            for (auto position = begin; position != end; ++position) {
+                auto next = step(id, _classes.find(*position));
+                if (next >= dead_row) {
+                    if (next == dead_row)
+                        break;
+                    next = _ids[static_cast<size_t>(_terminators[state_of(id)])];
+                }
+                id = next;
+                ++consumed;
+                if (hashed)
+                    running = token_hash_step(running, *position);
+                if (id & 1) {
+                    accepted_id = id;
+                    length = consumed;
+                    if (hashed)
+                        hash = running;
+                }
+            }
+
+            if (length != 0)
+                accepted = state_of(accepted_id);
+            return length;
+        }
+
+        template <bool hashed>
+        size_t tokenize(
+            const CharType* input,
+            size_t size,
+            lexer_cursor& cursor,
+            int* productions,
+            size_t* offsets,
+            size_t* lengths,
+            uint64_t* hashes,
+            size_t capacity
+        ) const {
+            size_t count = 0;
+            cursor.failed = false;
+            auto start = start_of(cursor.mode);
+
+            while (count < capacity && cursor.position < size) {
+                auto begin = input + cursor.position;
+                int accepted;
+                uint64_t hash;
+                auto length = longest<hashed>(start, begin, input + size, accepted, hash);
+                if (length == 0) {
+                    cursor.failed = true;
+                    break;
+                }
+
+                productions[count] = accept(accepted, begin, begin + length);
+                offsets[count] = cursor.position;
+                lengths[count] = length;
+                if (hashed)
+                    hashes[count] = hash;
+                cursor.position += length;
+                ++count;
+            }
+
+            return count;
+        }
+
+        int start_of(size_t mode) const {
+            if (mode >= _starts.size())
+                throw std::out_of_range("No such lexer mode.");
+            return _starts[mode];
+        }
+
+        int search(int state, CharType ch) const {
+            auto first = _ranges.begin() + _offsets[state];
+            auto last = _ranges.begin() + _offsets[state + 1];
+            auto it = std::upper_bound(first, last, ch, [](CharType c, const range& r) {
+                return c < r.lower;
+            });
+            if (it == first || (--it)->upper < ch)
+                return -1;
+            return it->next;
+        }
+
+        /* Row id reached from the row id on the character class, which may
+         * also be dead_row or terminator_row. */
+        int step(int id, uint16_t character_class) const {
+            if (id >= 0)
+                return _dense[static_cast<size_t>(id >> 1) + character_class];
+
+            const auto& current = _encoded[static_cast<size_t>(~id) >> 1];
+            switch (current.encoding) {
+            case transition_encoding::single:
+                if (character_class == current.character_class)
+                    return current.next;
+                break;
+            case transition_encoding::bitmap: {
+                auto word = character_class < 64
+                    ? current.bits
+                    : _bitmaps[current.offset + (character_class >> 6) - 1];
+                if ((word >> (character_class & 63)) & 1)
+                    return current.next;
+                for (auto entry = _sparse.data() + current.entries, last = entry + current.size;
+                     entry != last;
+                     ++entry) {
+                    if (entry->character_class == character_class)
+                        return entry->next;
+                }
+                break;
+            }
+            case transition_encoding::sparse:
+                for (auto entry = _sparse.data() + current.entries, last = entry + current.size;
+                     entry != last && entry->character_class <= character_class;
+                     ++entry) {
+                    if (entry->character_class == character_class)
+                        return entry->next;
+                }
+                break;
+            case transition_encoding::dense:
+                break;
+            }
+            return dead_row;
+        }
+
+        int state_of(int id) const {
+            if (id >= 0)
+                return _dense[static_cast<size_t>(id >> 1) - 1];
+            return _encoded[static_cast<size_t>(~id) >> 1].state;
+        }
+
+        /**
+         * Chooses the encoding of each state's row of the class table. States
+         * that loop on themselves (like the body of a string literal or of an
+         * identifier), where scanning spends most of its time, get a dense row.
+         * Of the others, the states with at most one transition (like most
+         * states spelling a keyword) or with transitions to a single next state
+         * need no lookup in a table, the ones with a few transitions are
+         * searched in a short list, and the ones with a few transitions that do
+         * not lead to their most common next state get a bitmap and a short
+         * list. Only the rest (like the start state) get a dense row. Identical
+         * bitmaps are stored once.
+         */
+        void compile_rows(const std::vector<int>& table) {
+            static constexpr size_t sparse_limit = 8;
+
+            const auto dead = static_cast<int>(_states.size());
+            const auto class_count = _classes.count;
+            const auto words = (class_count + 63) / 64;
+            std::map<std::vector<uint64_t>, size_t> bitmaps;
+            std::map<int, size_t> targets;
+            std::vector<uint64_t> bits;
+
+            // The encodings are chosen first, so that the row ids of the next
+            // states are known when the rows are filled.
+            _ids.resize(_states.size());
+            for (size_t i = 0; i < _states.size(); ++i) {
+                const int* cells = &table[i * class_count];
+                size_t count = 0, first = 0;
+                targets.clear();
+                for (size_t j = 0; j < class_count; ++j) {
+                    if (cells[j] == dead)
+                        continue;
+                    if (count++ == 0)
+                        first = j;
+                    ++targets[cells[j]];
+                }
+
+                int target = dead;
+                size_t common = 0;
+                for (auto&& entry : targets) {
+                    if (entry.second > common) {
+                        target = entry.first;
+                        common = entry.second;
+                    }
+                }
+
+                row current{};
+                current.encoding = transition_encoding::dense;
+                current.next = target;
+                current.state = static_cast<int>(i);
+                if (targets.count(static_cast<int>(i)) != 0) {
+                    current.encoding = transition_encoding::dense;
+                } else if (count <= 1) {
+                    current.encoding = transition_encoding::single;
+                    current.character_class = static_cast<uint16_t>(first);
+                } else if (count != common && count <= sparse_limit && 2 * count < class_count) {
+                    current.encoding = transition_encoding::sparse;
+                    current.size = static_cast<uint32_t>(count);
+                } else if (count - common <= sparse_limit) {
+                    current.encoding = transition_encoding::bitmap;
+                    current.size = static_cast<uint32_t>(count - common);
+                    bits.assign(words, 0);
+                    for (size_t j = 0; j < class_count; ++j) {
+                        if (cells[j] == target)
+                            bits[j >> 6] |= uint64_t(1) << (j & 63);
+                    }
+                    current.bits = bits.front();
+                    if (words > 1) {
+                        bits.erase(bits.begin());
+                        auto status = bitmaps.emplace(bits, _bitmaps.size());
+                        if (status.second)
+                            _bitmaps.insert(_bitmaps.end(), bits.begin(), bits.end());
+                        current.offset = static_cast<uint32_t>(status.first->second);
+                    }
+                }
+
+                auto accepting = static_cast<size_t>(_states[i].terminal);
+                if (current.encoding == transition_encoding::dense) {
+                    // The state precedes its row.
+                    _dense.push_back(static_cast<int>(i));
+                    current.offset = static_cast<uint32_t>(_dense.size());
+                    _dense.resize(_dense.size() + class_count);
+                    if (2 * _dense.size() >= static_cast<size_t>(dead_row)) {
+                        // Too large for row ids, scanning falls back to search().
+                        _ids.clear();
+                        _encoded.clear();
+                        _dense.clear();
+                        return;
+                    }
+                    _ids[i] = static_cast<int>(2 * current.offset + accepting);
+                } else {
+                    _ids[i] = ~static_cast<int>(2 * _encoded.size() + 1 - accepting);
+                }
+                _encoded.push_back(current);
+            }
 
-      public:
-        nfa(const std::basic_string<CharType>& regex, TokenInfo token_info) {
-            auto begin = regex.begin();
-            auto regex_node = parse_regex<CharType, TokenInfo>(begin, regex.end());
-            auto thunk = regex_node->nfa();
-            thunk.end->terminal = true;
-            thunk.end->token = token_info;
-            _start = thunk.begin;
+            auto id = [&](int next) {
+                if (next >= dead)
+                    return next == dead ? dead_row : terminator_row;
+                return _ids[static_cast<size_t>(next)];
+            };
+
+            for (auto&& current : _encoded) {
+                const int* cells = &table[static_cast<size_t>(current.state) * class_count];
+                auto target = current.next;
+                current.next = id(target);
+                current.entries = static_cast<uint32_t>(_sparse.size());
+                for (size_t j = 0; j < class_count; ++j) {
+                    switch (current.encoding) {
+                    case transition_encoding::dense:
+                        _dense[current.offset + j] = id(cells[j]);
+                        break;
+                    case transition_encoding::sparse:
+                        if (cells[j] != dead)
+                            _sparse.push_back({ static_cast<uint16_t>(j), id(cells[j]) });
+                        break;
+                    case transition_encoding::bitmap:
+                        if (cells[j] != dead && cells[j] != target)
+                            _sparse.push_back({ static_cast<uint16_t>(j), id(cells[j]) });
+                        break;
+                    case transition_encoding::single:
+                        break;
+                    }
+                }
+            }
         }
 
-        template <class Iterator>
-        nfa(Iterator begin, Iterator end) {
-            _start = new node_type();
-            for (; begin != end; ++begin) {
-                auto r_begin = begin->regex.begin();
-                auto regex_node = parse_regex<CharType, TokenInfo>(r_begin, begin->regex.end());
-                auto thunk = regex_node->nfa();
-                thunk.end->terminal = true;
-                thunk.end->token = begin->token;
-                _start->transitions.emplace_back(thunk.begin);
+        void compile_table() {
+            using code_point = typename character_classes<CharType>::code_point;
+
+            // Code points (in unsigned order) at which the transition of some
+            // state may change. NUL is kept apart for match_terminated().
+            std::vector<code_point> lowers{
+                0, 1, static_cast<code_point>(std::numeric_limits<CharType>::min())
+            };
+            for (auto&& range : _ranges) {
+                lowers.push_back(static_cast<code_point>(range.lower));
+                if (static_cast<code_point>(range.upper) != std::numeric_limits<code_point>::max())
+                    lowers.push_back(static_cast<code_point>(range.upper) + 1);
+            }
+            std::sort(lowers.begin(), lowers.end());
+            lowers.erase(std::unique(lowers.begin(), lowers.end()), lowers.end());
+
+            std::map<std::vector<int>, size_t> columns;
+            std::vector<int> column(_states.size() + 1);
+            std::vector<uint16_t> classes;
+
+            for (auto&& lower : lowers) {
+                for (size_t i = 0; i < _states.size(); ++i)
+                    column[i] = search(static_cast<int>(i), static_cast<CharType>(lower));
+                column.back() = lower == 0;
+                auto status = columns.emplace(column, columns.size());
+                if (status.first->second > std::numeric_limits<uint16_t>::max())
+                    return;
+                classes.push_back(static_cast<uint16_t>(status.first->second));
             }
-        }
 
-        const node_type& start() const {
-            return *_start;
-        }
+            _classes.build(std::move(lowers), std::move(classes), columns.size());
 
-        ~nfa() {
-            std::unordered_set<node_type*> visited;
-            std::queue<node_type*> to_visit;
+            auto dead = static_cast<int>(_states.size());
+            auto class_count = _classes.count;
+            std::vector<int> table((_states.size() + 1) * class_count, dead);
+            for (auto&& entry : columns) {
+                for (size_t i = 0; i < _states.size(); ++i) {
+                    if (entry.first[i] != -1)
+                        table[i * class_count + entry.second] = entry.first[i];
+                }
+            }
+
+            if (sizeof(CharType) == 1) {
+                const int* restarts = &table[static_cast<size_t>(_starts.front()) * class_count];
+                _fused.resize(table.size());
+                for (size_t i = 0; i < table.size(); ++i) {
+                    auto restart = restarts[i % class_count];
+                    if (table[i] != dead)
+                        _fused[i] = table[i] << 1;
+                    else if (_accepting[i / class_count] && restart != dead)
+                        _fused[i] = (restart << 1) | 1;
+                    else
+                        _fused[i] = dead << 1;
+                }
+            }
+
+            _terminators.assign(_states.size() + 1, dead);
+            for (size_t i = 0; i < _states.size(); ++i) {
+                auto& entry = table[i * class_count + _classes.find(CharType())];
+                _terminators[i] = entry;
+                if (entry != dead)
+                    entry = dead + 1;
+            }
 
-            to_visit.push(_start);
-            visited.insert(_start);
+            compile_rows(table);
+        }
 
-            while (!to_visit.empty()) {
-                for (auto&& transition : to_visit.front()->transitions) {
-                    if (visited.find(transition.next) == visited.end()) {
-                        to_visit.push(transition.next);
-                        visited.insert(transition.next);
+        void compile() {
+            _offsets.assign(1, 0);
+            for (auto&& state : _states) {
+                _accepting.push_back(state.terminal);
+                auto first = _ranges.size();
+                for (auto&& transition : state.transitions) {
+                    for (auto&& interval : transition.characters) {
+                        _ranges.push_back({ boost::icl::first(interval),
+                                            boost::icl::last(interval),
+                                            static_cast<int>(transition.next) });
                     }
                 }
-                delete to_visit.front();
-                to_visit.pop();
+                std::sort(
+                    _ranges.begin() + first,
+                    _ranges.end(),
+                    [](const range& a, const range& b) { return a.lower < b.lower; }
+                );
+                _offsets.push_back(_ranges.size());
             }
+
+            _accepting.push_back(false);
+            compile_table();
         }
-    };
 
-    template <typename CharType, typename TokenInfo>
-    struct dfa_node;
+      public:
+        template <typename Iterator>
+        lexer(Iterator begin, Iterator end, int start)
+          : _states(begin, end), _starts(1, start) {
+            compile();
+        }
 
-    template <typename CharType, typename TokenInfo>
-    struct dfa_transition {
-        using node_type = dfa_node<CharType, TokenInfo>;
+        template <typename Iterator>
+        lexer(Iterator begin, Iterator end, int start, const keyword_table_type& keywords)
+          : _states(begin, end), _starts(1, start), _keywords(keywords) {
+            compile();
+        }
 
-        boost::icl::interval_set<CharType> characters;
-        node_type* next;
+        /**
+         * Lexer with several modes sharing the states, starting in the given
+         * state in each mode.
+         */
+        template <typename Iterator>
+        lexer(
+            Iterator begin,
+            Iterator end,
+            const std::vector<int>& starts,
+            const keyword_table_type& keywords
+        )
+          : _states(begin, end), _starts(starts), _keywords(keywords) {
+            compile();
+        }
 
-        explicit dfa_transition(node_type* next_) : next(next_) {
+        const std::vector<lexer_node_type>& states() const {
+            return _states;
         }
 
-        dfa_transition(boost::icl::interval_set<CharType> characters_, node_type* next_)
-          : characters(characters_), next(next_) {
+        /**
+         * Start state of mode 0.
+         */
+        int start() const {
+            return _starts.front();
         }
-    };
 
-    template <typename CharType, typename TokenInfo>
-    struct dfa_node {
-        using nfa_node_type = nfa_node<CharType, TokenInfo>;
+        /**
+         * Start state of the mode, throws std::out_of_range if there is no such
+         * mode. Switching modes is just starting the next token there.
+         */
+        int start(size_t mode) const {
+            return start_of(mode);
+        }
 
-        std::unordered_set<const nfa_node_type*> nodes;
-        std::vector<dfa_transition<CharType, TokenInfo>> transitions;
+        size_t modes() const {
+            return _starts.size();
+        }
 
-        explicit dfa_node(const std::unordered_set<const nfa_node_type*>& nfa_nodes)
-          : nodes(nfa_nodes) {
+        const keyword_table_type& keywords() const {
+            return _keywords;
         }
 
-        bool terminal() const {
-            for (const auto& node : nodes) {
-                if (node->terminal)
-                    return true;
+        /**
+         * Character classes of the dense transition table, which code
+         * generators can emit as lookup tables. Empty (count == 0) if there are
+         * too many classes for a table.
+         */
+        const character_classes<CharType>& classes() const {
+            return _classes;
+        }
+
+        /**
+         * Returns the state reached from the state on the character, or -1 if
+         * there is no such transition.
+         */
+        int next(int state, CharType ch) const {
+            if (_ids.empty())
+                return search(state, ch);
+
+            auto next = step(_ids[static_cast<size_t>(state)], _classes.find(ch));
+            if (next == terminator_row)
+                return _terminators[static_cast<size_t>(state)];
+            return next == dead_row ? -1 : state_of(next);
+        }
+
+        /**
+         * Encoding of the state's transitions in the class table, for code
+         * generators that choose how to emit a state in the same way. Dense if
+         * there is no class table.
+         */
+        transition_encoding encoding(int state) const {
+            if (_encoded.empty())
+                return transition_encoding::dense;
+            return _encoded.at(static_cast<size_t>(state)).encoding;
+        }
+
+        /**
+         * Finds the longest token at the beginning of the input in mode 0 and
+         * returns its length, or 0 if no non-empty token matches there. The
+         * production that accepted the token (after keyword reclassification)
+         * is stored in production. Tokens of other modes are matched with
+         * tokenize().
+         */
+        template <typename Iterator>
+        size_t match(Iterator begin, Iterator end, int& production) const {
+            int accepted;
+            auto length = longest(_starts.front(), begin, end, accepted);
+            if (length == 0)
+                return 0;
+
+            auto last = begin;
+            std::advance(last, length);
+            production = accept(accepted, begin, last);
+            return length;
+        }
+
+        /**
+         * Same as match(), and also stores the token_hash() of the token,
+         * computed while scanning, in hash.
+         */
+        template <typename Iterator>
+        size_t match(Iterator begin, Iterator end, int& production, uint64_t& hash) const {
+            int accepted;
+            auto length = longest<true>(_starts.front(), begin, end, accepted, hash);
+            if (length == 0)
+                return 0;
+
+            auto last = begin;
+            std::advance(last, length);
+            production = accept(accepted, begin, last);
+            return length;
+        }
+
+        /**
+         * Same as match() on contiguous input that is followed by a NUL sentinel
+         * (*end has to be CharType(), and is not part of the input). The scanning
+         * loop then needs no check for the end of the input, except on a NUL
+         * character in the states that have a transition on it.
+         */
+        size_t match_terminated(const CharType* begin, const CharType* end, int& production) const {
+            if (_ids.empty())
+                return match(begin, end, production);
+
+            int id = _ids[static_cast<size_t>(_starts.front())];
+            int accepted = id;
+            size_t length = 0;
+
+            for (auto position = begin;; ++position) {
+                auto next = step(id, _classes.find(*position));
+                if (next >= dead_row) {
+                    if (next == dead_row || position == end)
+                        break;
+                    next = _ids[static_cast<size_t>(_terminators[state_of(id)])];
+                }
+                id = next;
+                if (id & 1) {
+                    accepted = id;
+                    length = static_cast<size_t>(position - begin) + 1;
+                }
             }
-            return false;
+
+            if (length == 0)
+                return 0;
+            production = accept(state_of(accepted), begin, begin + length);
+            return length;
         }
 
-        TokenInfo get_terminal() const {
-            std::vector<TokenInfo> ti;
-            for (auto&& nfa_node : nodes) {
-                if (nfa_node->terminal)
-                    ti.push_back(nfa_node->token);
+        /**
+         * Returns the production of the token [begin, end) accepted in the
+         * state, reclassifying it if it is a keyword.
+         */
+        template <typename Iterator>
+        int accept(int state, Iterator begin, Iterator end) const {
+            if (_states[state].keywords) {
+                auto index = _keywords.find(begin, end);
+                if (index != -1)
+                    return _keywords.productions[index];
             }
+            return _states[state].production;
+        }
 
-            if (ti.empty())
-                return TokenInfo();
-            return *std::min_element(ti.begin(), ti.end());
+        /**
+         * Tokenizes the input starting at cursor.position into columnar buffers:
+         * for up to capacity tokens the accepting production, the offset and the
+         * length are stored. Returns the number of tokens written and advances
+         * the cursor past them, so that the next call continues where this one
+         * stopped. If no token matches at the cursor, cursor.failed is set and
+         * the cursor is left at the offending character.
+         */
+        size_t tokenize(
+            const CharType* input,
+            size_t size,
+            lexer_cursor& cursor,
+            int* productions,
+            size_t* offsets,
+            size_t* lengths,
+            size_t capacity
+        ) const {
+            return tokenize<false>(
+                input, size, cursor, productions, offsets, lengths, nullptr, capacity
+            );
         }
 
-        dfa_node() {
+        /**
+         * Same as tokenize() above, and also stores the token_hash() of every
+         * token, computed while scanning, so that tokens can be interned into a
+         * symbol_table without hashing them again.
+         */
+        size_t tokenize(
+            const CharType* input,
+            size_t size,
+            lexer_cursor& cursor,
+            int* productions,
+            size_t* offsets,
+            size_t* lengths,
+            uint64_t* hashes,
+            size_t capacity
+        ) const {
+            return tokenize<true>(
+                input, size, cursor, productions, offsets, lengths, hashes, capacity
+            );
         }
-    };
 
-    /**
-     * Returns all states reachable from any of the input NFA states by following
-     * a transition containing specified interval (this is a generalization of
-     * move(T, a) for alphabet symbol a to intervals of symbols)
-     */
-    template <typename T, typename CharType, typename TokenInfo>
-    void move_s(
-        std::unordered_set<const nfa_node<CharType, TokenInfo>*>& dest,
-        const T& nodes,
-        const boost::icl::discrete_interval<CharType>& chars
-    ) {
-        for (auto&& node : nodes) {
-            for (auto&& trans : node->transitions) {
-                if (boost::icl::contains(trans.characters, chars)) {
-                    dest.insert(trans.next);
+        /**
+         * Tokenizes many independent inputs (e.g. log lines or messages) at once.
+         * Scanning a single input is bound by the latency of the transition
+         * lookups, each of which depends on the previous one, so the steps of
+         * several inputs are interleaved to keep independent lookups in flight.
+         *
+         * To keep the interleaved steps free of branches that depend on the
+         * input, the end of a token is recognized within the transition table
+         * (see _fused) and the token is written out unconditionally, advancing
+         * the output only if it ended. Tokens that need backtracking or input
+         * that no token matches stop the input for an ordinary match().
+         *
+         * Only single byte characters have the dense transition table this needs,
+         * other inputs are tokenized one after another, and so are the inputs
+         * whose cursor is not in mode 0, since the table restarts tokens there.
+         */
+        void tokenize(lexer_input<CharType>* inputs, size_t count) const {
+            if (_fused.empty()) {
+                for (size_t i = 0; i < count; ++i) {
+                    auto& input = inputs[i];
+                    input.count = tokenize(
+                        input.data,
+                        input.size,
+                        input.cursor,
+                        input.productions,
+                        input.offsets,
+                        input.lengths,
+                        input.capacity
+                    );
+                }
+                return;
+            }
+
+            static constexpr size_t lanes = 8;
+
+            struct lane {
+                lexer_input<CharType>* input;
+                const CharType* data;
+                int* productions;
+                size_t* offsets;
+                size_t size;
+                size_t start;
+                size_t position;
+                size_t count;
+                int state;
+            };
+
+            const auto dead = static_cast<int>(_states.size());
+            const int* fused = _fused.data();
+            const uint16_t* classes = _classes.latin.data();
+            const size_t class_count = _classes.count;
+
+            lane active[lanes];
+            size_t used = 0;
+            size_t waiting = 0;
+
+            // Until the input is finished, productions holds the accepting states
+            // of its tokens and offsets their ends (the tokens are contiguous).
+            auto begin = [](const lane& current) {
+                return current.count == 0 ? current.start : current.offsets[current.count - 1];
+            };
+
+            auto finish = [&](lane& current) {
+                auto& input = *current.input;
+                auto offset = current.start;
+                for (size_t i = 0; i < current.count; ++i) {
+                    auto end = input.offsets[i];
+                    input.offsets[i] = offset;
+                    input.lengths[i] = end - offset;
+                    input.productions[i] = accept(
+                        input.productions[i], current.data + offset, current.data + end
+                    );
+                    offset = end;
+                }
+                input.count = current.count;
+                input.cursor.position = offset;
+            };
+
+            auto emit = [&](lane& current, int state, size_t end) {
+                current.productions[current.count] = state;
+                current.offsets[current.count] = end;
+                ++current.count;
+                current.position = end;
+                current.state = _starts.front();
+            };
+
+            // Brings the lane to a state from which the interleaved loop can
+            // continue, returns false when the input is done.
+            auto settle = [&](lane& current) {
+                auto& input = *current.input;
+                for (;;) {
+                    if (current.count == input.capacity)
+                        return false;
+
+                    auto first = begin(current);
+                    if (current.state == dead) {
+                        int accepted;
+                        auto length = longest(
+                            _starts.front(),
+                            current.data + first,
+                            current.data + current.size,
+                            accepted
+                        );
+                        if (length == 0) {
+                            input.cursor.failed = true;
+                            return false;
+                        }
+                        emit(current, accepted, first + length);
+                        continue;
+                    }
+
+                    if (current.position == current.size) {
+                        if (first == current.size)
+                            return false;
+                        if (_accepting[current.state]) {
+                            emit(current, current.state, current.size);
+                            continue;
+                        }
+                        current.state = dead;
+                        continue;
+                    }
+
+                    return true;
+                }
+            };
+
+            auto load = [&](lane& current) {
+                while (waiting < count) {
+                    auto& input = inputs[waiting++];
+                    if (input.cursor.mode != 0) {
+                        input.count = tokenize(
+                            input.data,
+                            input.size,
+                            input.cursor,
+                            input.productions,
+                            input.offsets,
+                            input.lengths,
+                            input.capacity
+                        );
+                        continue;
+                    }
+
+                    input.count = 0;
+                    input.cursor.failed = false;
+
+                    current.input = &input;
+                    current.data = input.data;
+                    current.productions = input.productions;
+                    current.offsets = input.offsets;
+                    current.size = input.size;
+                    current.start = current.position = input.cursor.position;
+                    current.count = 0;
+                    current.state = _starts.front();
+
+                    if (settle(current))
+                        return true;
+                    finish(current);
+                }
+                return false;
+            };
+
+            while (used < lanes && load(active[used]))
+                ++used;
+
+            while (used > 0) {
+                size_t steps = std::numeric_limits<size_t>::max();
+                for (size_t i = 0; i < used; ++i) {
+                    auto& current = active[i];
+                    steps = std::min(steps, current.size - current.position);
+                    steps = std::min(steps, current.input->capacity - current.count);
+                }
+
+                bool stopped = false;
+                for (; steps > 0 && !stopped; --steps) {
+                    for (size_t i = 0; i < used; ++i) {
+                        auto& current = active[i];
+                        auto position = current.position++;
+                        auto ch = static_cast<unsigned char>(current.data[position]);
+                        auto next = fused[static_cast<size_t>(current.state) * class_count +
+                                          classes[ch]];
+
+                        current.productions[current.count] = current.state;
+                        current.offsets[current.count] = position;
+                        current.count += static_cast<size_t>(next & 1);
+                        current.state = next >> 1;
+                        stopped |= current.state == dead;
+                    }
+                }
+
+                for (size_t i = 0; i < used;) {
+                    auto& current = active[i];
+                    if (current.state != dead && current.position != current.size &&
+                        current.count != current.input->capacity) {
+                        ++i;
+                        continue;
+                    }
+
+                    if (settle(current)) {
+                        ++i;
+                        continue;
+                    }
+
+                    finish(current);
+                    if (!load(current))
+                        current = active[--used];
+                    else
+                        ++i;
                 }
             }
         }
-    }
 
-    /**
-     * Computes the epsilon-closure of a set of NFA states i.e. all states
-     * reachable
-     * from them following
-     * only epsilon transitions.
-     */
-    template <typename CharType, typename TokenInfo, typename T>
-    void eclosure(std::unordered_set<const nfa_node<CharType, TokenInfo>*>& dest, const T& nodes) {
-        std::queue<const nfa_node<CharType, TokenInfo>*> to_visit;
+        /**
+         * Tokenizes the input by longest match in mode 0 and adds the states
+         * visited and the transitions taken to the profile. Characters that do
+         * not start any token are skipped.
+         */
+        template <typename Iterator>
+        void profile(Iterator begin, Iterator end, lexer_profile& profile) const {
+            if (profile.visits.empty()) {
+                profile.visits.assign(_states.size(), 0);
+                profile.transitions.resize(_states.size());
+                for (size_t i = 0; i < _states.size(); ++i)
+                    profile.transitions[i].assign(_states[i].transitions.size(), 0);
+            } else if (profile.visits.size() != _states.size()) {
+                throw std::runtime_error("Profile does not match the lexer.");
+            }
 
-        for (auto&& node : nodes) {
-            to_visit.push(node);
-            dest.insert(node);
+            while (begin != end) {
+                size_t state = _starts.front();
+                Iterator accepted = begin;
+                bool accepting = false;
+                ++profile.visits[state];
+
+                for (auto position = begin; position != end; ++position) {
+                    const auto& transitions = _states[state].transitions;
+                    size_t i = 0;
+                    while (i < transitions.size() &&
+                           !boost::icl::contains(transitions[i].characters, *position))
+                        ++i;
+                    if (i == transitions.size())
+                        break;
+
+                    ++profile.transitions[state][i];
+                    state = transitions[i].next;
+                    ++profile.visits[state];
+                    if (_states[state].terminal) {
+                        accepted = std::next(position);
+                        accepting = true;
+                    }
+                }
+
+                begin = accepting ? accepted : std::next(begin);
+            }
         }
 
-        while (!to_visit.empty()) {
-            for (auto&& trans : to_visit.front()->transitions) {
-                if (trans.epsilon) {
-                    if (dest.find(trans.next) == dest.end()) {
-                        to_visit.push(trans.next);
-                        dest.insert(trans.next);
+        /**
+         * Writes the states and the keywords, but not the additional info of the
+         * productions, which lexer_generator::load() takes from the grammar.
+         */
+        void save(std::ostream& out) const {
+            out << "supercomplex-lexer 2" << std::endl << _states.size() << " " << _starts.size();
+            for (auto&& start : _starts)
+                out << " " << start;
+            out << std::endl;
+            for (auto&& state : _states) {
+                out << state.production << " " << state.keywords << " " << state.transitions.size();
+                for (auto&& transition : state.transitions) {
+                    out << " " << transition.next << " "
+                        << boost::icl::interval_count(transition.characters);
+                    for (auto&& interval : transition.characters) {
+                        out << " " << static_cast<int64_t>(boost::icl::first(interval)) << " "
+                            << static_cast<int64_t>(boost::icl::last(interval));
                     }
                 }
+                out << std::endl;
+            }
+
+            out << _keywords.words.size() << std::endl;
+            for (size_t i = 0; i < _keywords.words.size(); ++i) {
+                out << _keywords.productions[i] << " " << _keywords.words[i].size();
+                for (auto&& ch : _keywords.words[i])
+                    out << " " << static_cast<int64_t>(ch);
+                out << std::endl;
             }
-            to_visit.pop();
         }
-    }
+    };
+
+    template <typename CharType>
+    struct lexer_token {
+        int production;
+        size_t offset;
+        std::basic_string<CharType> value;
+    };
 
     /**
-     * Takes a collection of interval sets and splits their union into disjoint
-     * intervals corresponding to all
-     * possible intersections between collections.
+     * Tokenizes input that arrives in chunks. A token may span any number of
+     * chunks, only the characters of the token being matched are kept.
+     *
+     * next() returns false when it needs more input, in which case the next
+     * chunk is passed to feed() (the previous one is no longer referenced), or
+     * close() if there is none. It also returns false once the input is closed
+     * and exhausted (finished()) or when no token matches (failed()).
      */
-    template <typename CharType, typename T>
-    void make_disjoint(std::set<boost::icl::discrete_interval<CharType>>& dest, const T& nodes) {
-        std::vector<std::pair<bool, CharType>> vec;
-        for (auto&& node : nodes) {
-            for (auto&& trans : node->transitions) {
-                for (auto&& inter : trans.characters) {
-                    vec.push_back({ true, inter.lower() });
-                    vec.push_back({ false, inter.upper() });
-                }
+    template <typename CharType, typename AdditionalInfo>
+    class lexer_stream {
+        const lexer<CharType, AdditionalInfo>& _lexer;
+
+        const CharType* _chunk;
+        size_t _size;
+        size_t _position;
+
+        /* Characters read past the last accepted token, read again before the
+         * rest of the chunk. */
+        std::basic_string<CharType> _pending;
+        size_t _pending_position;
+
+        std::basic_string<CharType> _lexeme;
+        size_t _offset;
+        size_t _mode;
+        int _state;
+        int _accepted;
+        size_t _accepted_length;
+
+        bool _closed;
+        bool _failed;
+
+        bool peek(CharType& ch) const {
+            if (_pending_position < _pending.size()) {
+                ch = _pending[_pending_position];
+                return true;
+            }
+            if (_position < _size) {
+                ch = _chunk[_position];
+                return true;
             }
+            return false;
         }
-        sort(vec.begin(), vec.end(), [](std::pair<bool, CharType> a, std::pair<bool, CharType> b) {
-            return a.second < b.second || ((a.second == b.second) && (a.first && !b.first));
-        });
 
-        int depth = 0;
-        std::pair<bool, CharType> last;
+        void advance() {
+            if (_pending_position < _pending.size())
+                ++_pending_position;
+            else
+                ++_position;
+        }
 
-        for (auto current : vec) {
-            if (depth != 0) {
-                auto lower = last.second + (last.first ? 0 : 1);
-                auto upper = current.second - (current.first ? 1 : 0);
+      public:
+        explicit lexer_stream(const lexer<CharType, AdditionalInfo>& lexer_)
+          : _lexer(lexer_),
+            _chunk(nullptr),
+            _size(0),
+            _position(0),
+            _pending_position(0),
+            _offset(0),
+            _mode(0),
+            _state(lexer_.start()),
+            _accepted(-1),
+            _accepted_length(0),
+            _closed(false),
+            _failed(false) {
+        }
 
-                if (lower <= upper) {
-                    dest.insert(boost::icl::construct<boost::icl::discrete_interval<CharType>>(
-                        lower, upper, boost::icl::interval_bounds::closed()
-                    ));
+        void feed(const CharType* chunk, size_t size) {
+            _chunk = chunk;
+            _size = size;
+            _position = 0;
+        }
+
+        void close() {
+            _closed = true;
+        }
+
+        /**
+         * Switches to the mode (see lexer_production::modes) from the next
+         * token on, typically right after the token that enters it.
+         */
+        void mode(size_t mode) {
+            auto start = _lexer.start(mode);
+            _mode = mode;
+            if (_lexeme.empty())
+                _state = start;
+        }
+
+        size_t mode() const {
+            return _mode;
+        }
+
+        bool next(lexer_token<CharType>& token) {
+            if (_failed)
+                return false;
+
+            for (;;) {
+                CharType ch;
+                bool available = peek(ch);
+                if (!available && !_closed)
+                    return false;
+
+                if (available) {
+                    int state = _lexer.next(_state, ch);
+                    if (state != -1) {
+                        advance();
+                        _lexeme.push_back(ch);
+                        _state = state;
+                        if (_lexer.states()[state].terminal) {
+                            _accepted = state;
+                            _accepted_length = _lexeme.size();
+                        }
+                        continue;
+                    }
+                } else if (_lexeme.empty()) {
+                    return false;
+                }
+
+                if (_accepted == -1) {
+                    _failed = true;
+                    return false;
                 }
+
+                token.production =
+                    _lexer.accept(_accepted, _lexeme.begin(), _lexeme.begin() + _accepted_length);
+                token.offset = _offset;
+                token.value.assign(_lexeme, 0, _accepted_length);
+
+                _pending.erase(0, _pending_position);
+                _pending.insert(0, _lexeme, _accepted_length, std::basic_string<CharType>::npos);
+                _pending_position = 0;
+
+                _offset += _accepted_length;
+                _lexeme.clear();
+                _state = _lexer.start(_mode);
+                _accepted = -1;
+                return true;
             }
+        }
+
+        bool finished() const {
+            return _closed && !_failed && _lexeme.empty() &&
+                   _pending_position == _pending.size() && _position == _size;
+        }
+
+        bool failed() const {
+            return _failed;
+        }
+
+        /**
+         * Offset of the token being matched, i.e. where matching failed.
+         */
+        size_t offset() const {
+            return _offset;
+        }
+    };
+
+    template <typename CharType, typename AdditionalInfo>
+    struct lexer_production {
+        std::basic_string<CharType> regex;
+        AdditionalInfo node;
+
+        /**
+         * Bit m is set if the production is matched in mode m (only mode 0 by
+         * default). All the modes are compiled into one automaton with a start
+         * state for each of them (see lexer::start()), so productions shared by
+         * several modes share their states.
+         */
+        uint64_t modes;
+
+        lexer_production(
+            AdditionalInfo node_,
+            const std::basic_string<CharType>& regex_,
+            uint64_t modes_ = 1
+        )
+          : regex(regex_), node(node_), modes(modes_){};
+    };
+
+    /**
+     * A production matching any of a (possibly very large) set of literal words,
+     * such as reserved words or stop lists. All the words share the precedence
+     * of the dictionary.
+     */
+    template <typename CharType, typename AdditionalInfo>
+    struct lexer_dictionary {
+        std::vector<std::basic_string<CharType>> words;
+        AdditionalInfo node;
+        uint64_t modes;
+
+        lexer_dictionary(
+            AdditionalInfo node_,
+            std::vector<std::basic_string<CharType>> words_,
+            uint64_t modes_ = 1
+        )
+          : words(std::move(words_)), node(node_), modes(modes_){};
+    };
+
+    /**
+     * Numbering of the states of a generated lexer. Both orders are canonical,
+     * depth_first keeps the states along a path (e.g. the characters of a
+     * keyword) next to each other.
+     */
+    enum class state_order { breadth_first, depth_first };
+
+    struct lexer_options {
+        nfa_construction construction;
+        state_order order;
+
+        /**
+         * Drop literal productions (and dictionaries) whose words are also
+         * matched by a production with lower precedence, e.g. keywords and an
+         * identifier rule, from the automaton. The generated lexer has to look
+         * the lexemes accepted by such productions up in lexer::keywords().
+         */
+        bool classify_keywords;
 
-            last = current;
+        /**
+         * Keep the NFA of every production and the subset construction steps
+         * between calls to generate(), so that after productions are added or
+         * replaced only the DFA states involving them are determinized again.
+         * The generated lexer is the same as without it.
+         */
+        bool incremental;
 
-            if (current.first) {
-                depth++;
-            }
-            if (!current.first) {
-                depth--;
-            }
+        /**
+         * Simplify the NFA (see nfa::simplify()) before the subset construction.
+         * Off by default: the pass usually takes longer than it saves the subset
+         * construction.
+         */
+        bool simplify_nfa;
+
+        lexer_options()
+          : construction(nfa_construction::thompson),
+            order(state_order::breadth_first),
+            classify_keywords(false),
+            incremental(false),
+            simplify_nfa(false) {
         }
-    }
+    };
 
-    template <typename CharType, typename TokenInfo>
-    class dfa {
-      public:
-        using node_type = dfa_node<CharType, TokenInfo>;
-        using nfa_node_type = nfa_node<CharType, TokenInfo>;
-        using set_type = std::unordered_set<dfa_node<CharType, TokenInfo>*>;
+    template <typename CharType, typename AdditionalInfo>
+    class lexer_generator {
+        using token_info_type = basic_token_info<AdditionalInfo>;
+        using terminal_node_type = terminal_node<CharType, token_info_type>;
+        using dictionary_node_type = dictionary_node<CharType, token_info_type>;
+        using lexer_node_type = lexer_node<CharType, AdditionalInfo>;
+        using keyword_table_type = keyword_table<CharType, AdditionalInfo>;
 
-      private:
-        set_type _nodes;
-        node_type* _initial;
+        // Literal productions with more words than this are never reclassified.
+        static constexpr size_t max_keywords = 4096;
 
-        dfa(const dfa& other) = delete;
-        dfa& operator=(const dfa&) = delete;
+        // Bumped whenever the same grammar starts generating a different lexer,
+        // so that lexers cached by fingerprint() are not reused (1: bounded
+        // repetitions, before which a{2} matched the literal text).
+        static constexpr uint64_t grammar_version = 1;
 
-        struct dfa_set_hash {
-            size_t operator()(const set_type& x) const {
-                size_t hash = 2166136261;
-                for (auto&& part : x)
-                    hash = hash * 16777619 ^ reinterpret_cast<size_t>(part);
-                return hash;
-            }
-        };
+        using nfa_type = nfa<CharType, token_info_type>;
+        using nfa_node_type = nfa_node<CharType, token_info_type>;
 
-        struct dfa_set_eq {
-            bool operator()(const set_type& x, const set_type& y) const {
-                return x == y;
-            }
+        std::vector<terminal_node_type> productions;
+        std::vector<dictionary_node_type> dictionaries;
+        int seq_number;
+        lexer_options options;
+        regex_arena<CharType> arena;
+
+        /* NFAs of the productions and dictionaries by precedence, kept for
+         * incremental generation. generate() writes the tokens into them, so
+         * copies of the generator start without them. */
+        struct fragment {
+            std::basic_string<CharType> regex;
+            std::vector<std::basic_string<CharType>> words;
+            std::shared_ptr<nfa_type> automaton;
+            nfa_reduction reduction;
         };
+        std::map<int, fragment> production_fragments;
+        std::map<int, fragment> dictionary_fragments;
+        dfa_cache<CharType, token_info_type> cache;
+
+        /* Effect of nfa::simplify() on the NFA of the last build(). */
+        nfa_reduction last_reduction;
+
+        void reset(fragment& entry, nfa_type* automaton) {
+            if (entry.automaton)
+                cache.remove_fragment(entry.automaton->start());
+            entry.reduction = nfa_reduction();
+            if (options.simplify_nfa)
+                entry.reduction = automaton->simplify();
+            entry.automaton.reset(automaton);
+            cache.add_fragment(automaton->start());
+        }
 
-        struct dfa_node_hash {
-            size_t operator()(node_type* x) const {
-                size_t hash = 2166136261;
-                for (auto&& part : x->nodes)
-                    hash = hash * 16777619 ^ reinterpret_cast<size_t>(part);
-                return hash;
+        /* The additional info of a production may change without its regex, so
+         * the token of a reused fragment is always updated. */
+        static nfa_node_type& retoken(fragment& entry, const token_info_type& token) {
+            std::vector<nfa_node_type*> nodes{ &entry.automaton->start() };
+            std::unordered_set<nfa_node_type*> visited{ nodes.front() };
+            for (size_t i = 0; i < nodes.size(); ++i) {
+                if (nodes[i]->terminal)
+                    nodes[i]->token = token;
+                for (auto&& transition : nodes[i]->transitions) {
+                    if (visited.insert(transition.next).second)
+                        nodes.push_back(transition.next);
+                }
             }
-        };
+            return *nodes.front();
+        }
 
-        struct dfa_node_eq {
-            bool operator()(node_type* x, node_type* y) const {
-                return x->nodes == y->nodes;
+        nfa_node_type& production_fragment(const terminal_node_type& production) {
+            auto& entry = production_fragments[production.token.precedence];
+            if (!entry.automaton || entry.regex != production.regex) {
+                auto automaton =
+                    new nfa_type(production.regex, production.token, options.construction);
+                reset(entry, automaton);
+                entry.regex = production.regex;
             }
-        };
+            return retoken(entry, production.token);
+        }
 
-        void aggregate() {
-            for (auto& node : _nodes) {
-                std::sort(
-                    node->transitions.begin(),
-                    node->transitions.end(),
-                    [](const dfa_transition<CharType, TokenInfo>& a,
-                       const dfa_transition<CharType, TokenInfo>& b) { return a.next < b.next; }
-                );
+        nfa_node_type& dictionary_fragment(const dictionary_node_type& dictionary) {
+            auto& entry = dictionary_fragments[dictionary.token.precedence];
+            if (!entry.automaton || entry.words != dictionary.words) {
+                reset(entry, new nfa_type(dictionary.words, dictionary.token));
+                entry.words = dictionary.words;
+            }
+            return retoken(entry, dictionary.token);
+        }
 
-                for (size_t i = 1; i < node->transitions.size(); ++i) {
-                    if (node->transitions[i].next == node->transitions[i - 1].next) {
-                        for (auto&& inter : node->transitions[i].characters)
-                            node->transitions[i - 1].characters.add(inter);
-                        node->transitions.erase(node->transitions.begin() + i);
-                        --i;
+        std::vector<int> build(
+            const std::vector<terminal_node_type>& productions_,
+            const std::vector<dictionary_node_type>& dictionaries_,
+            std::vector<lexer_node_type>& nodes
+        ) {
+            std::unique_ptr<nfa_type> nfa_machine;
+            std::vector<nfa_node_type> roots(modes());
+            std::vector<const nfa_node_type*> starts;
+
+            // Incrementally, the start state of every mode links to the NFAs of
+            // its productions with epsilon transitions, which gives the same
+            // language and thus the same minimal DFA.
+            last_reduction = nfa_reduction();
+            if (options.incremental) {
+                auto link = [&roots](nfa_node_type& fragment, uint64_t mask) {
+                    for (size_t mode = 0; mode < roots.size(); ++mode) {
+                        if (((mask >> mode) & 1) != 0)
+                            roots[mode].transitions.emplace_back(&fragment);
                     }
+                };
+                for (auto&& production : productions_) {
+                    link(production_fragment(production), production.modes);
+                    last_reduction += production_fragments[production.token.precedence].reduction;
+                }
+                for (auto&& dictionary : dictionaries_) {
+                    link(dictionary_fragment(dictionary), dictionary.modes);
+                    last_reduction += dictionary_fragments[dictionary.token.precedence].reduction;
                 }
+                for (auto&& root : roots)
+                    starts.push_back(&root);
+            } else {
+                nfa_machine.reset(new nfa_type(
+                    arena,
+                    productions_.begin(),
+                    productions_.end(),
+                    options.construction,
+                    roots.size()
+                ));
+                for (auto&& dictionary : dictionaries_) {
+                    nfa_machine->add_dictionary(
+                        dictionary.words, dictionary.token, dictionary.modes
+                    );
+                }
+                if (options.simplify_nfa)
+                    last_reduction = nfa_machine->simplify();
+                for (size_t mode = 0; mode < roots.size(); ++mode)
+                    starts.push_back(&nfa_machine->start(mode));
             }
-        }
 
-        /**
-         * Part of the Moore's algorithm for DFA state minimization. Check whether
-         * two
-         * states are equivalent under a
-         * specified equivalence relation (for each input symbol a, the
-         * a-transitions of both states lead to the same element of the set
-         * partition.
-         */
-        bool check_equivalence(
-            const node_type* state1,
-            const node_type* state2,
-            const std::unordered_map<node_type*, const set_type*>& Map
-        ) {
-            if (state1 == state2)
-                return true;
-            std::set<boost::icl::discrete_interval<CharType>> letters;
-            make_disjoint<CharType>(
-                letters, std::initializer_list<const node_type*>{ state1, state2 }
+            dfa<CharType, token_info_type> dfa_machine(
+                starts, options.incremental ? &cache : nullptr
             );
 
-            for (auto&& interval : letters) {
-                node_type* next1 = nullptr;
-                node_type* next2 = nullptr;
+            // The DFA does not refer to the NFA once constructed, so release it
+            // before minimization.
+            nfa_machine.reset();
+            dfa_machine.optimize();
 
-                for (const auto& tran : state1->transitions) {
-                    if (boost::icl::contains(tran.characters, interval)) {
-                        next1 = tran.next;
+            // States are numbered by a traversal from the start state of each
+            // mode in turn, following transitions in the order of characters, so
+            // that the same grammar always produces the same lexer.
+            using dfa_node_type = dfa_node<CharType, token_info_type>;
+            std::unordered_map<const dfa_node_type*, int> index;
+            std::vector<const dfa_node_type*> order;
+            int base = static_cast<int>(nodes.size());
+
+            if (options.order == state_order::depth_first) {
+                std::vector<const dfa_node_type*> to_visit;
+                for (auto&& start : dfa_machine.starts()) {
+                    to_visit.push_back(start);
+                    while (!to_visit.empty()) {
+                        auto state = to_visit.back();
+                        to_visit.pop_back();
+                        if (!index.emplace(state, base + static_cast<int>(order.size())).second)
+                            continue;
+                        order.push_back(state);
+                        for (auto it = state->transitions.rbegin();
+                             it != state->transitions.rend();
+                             ++it) {
+                            if (index.find(it->next) == index.end())
+                                to_visit.push_back(it->next);
+                        }
                     }
                 }
-
-                for (const auto& tran : state2->transitions) {
-                    if (boost::icl::contains(tran.characters, interval)) {
-                        next2 = tran.next;
+            } else {
+                size_t visited = 0;
+                for (auto&& start : dfa_machine.starts()) {
+                    if (index.emplace(start, base + static_cast<int>(order.size())).second)
+                        order.push_back(start);
+                    for (; visited < order.size(); ++visited) {
+                        for (auto&& transition : order[visited]->transitions) {
+                            if (index
+                                    .emplace(transition.next, base + static_cast<int>(order.size()))
+                                    .second)
+                                order.push_back(transition.next);
+                        }
                     }
                 }
-
-                if ((next1 == nullptr) ^ (next2 == nullptr))
-                    return false;
-                if ((next1 == nullptr) && (next2 == nullptr))
-                    continue;
-                if (Map.at(next1) != Map.at(next2))
-                    return false;
             }
 
-            return true;
-        }
-
-      public:
-        dfa(const nfa_node_type& start) {
-            auto initial = new node_type();
-
-            std::unordered_set<node_type*> unmarked;
-            std::unordered_set<node_type*, dfa_node_hash, dfa_node_eq> result;
-            std::unordered_set<const nfa_node_type*> moved;
-
-            std::initializer_list<const nfa_node_type*> start_nodes{ &start };
-            eclosure(initial->nodes, start_nodes);
-
-            result.insert(initial);
-            unmarked.insert(initial);
-
-            while (!unmarked.empty()) {
-                auto it = unmarked.begin();
-                auto D = *it;
-
-                unmarked.erase(it);
-
-                std::set<boost::icl::discrete_interval<CharType>> letters;
-                make_disjoint<CharType>(letters, D->nodes);
-
-                for (auto&& inter : letters) {
-                    auto new_node = new node_type();
-                    moved.clear();
-                    move_s(moved, D->nodes, inter);
-                    eclosure(new_node->nodes, moved);
-
-                    bool inserted = false;
-                    if (!new_node->nodes.empty()) {
-                        auto status = result.emplace(new_node);
-                        if (status.second) {
-                            unmarked.insert(new_node);
-                            inserted = true;
-                        }
+            for (auto&& state : order)
+                nodes.emplace_back(*state);
 
-                        boost::icl::interval_set<CharType> iset;
-                        iset.add(inter);
-                        D->transitions.emplace_back(iset, *status.first);
-                    }
+            // Intervals leading to the same state are grouped into a single
+            // transition.
+            std::unordered_map<int, size_t> targets;
+            for (auto&& state : order) {
+                auto& transitions = nodes[index[state]].transitions;
+                targets.clear();
 
-                    if (!inserted)
-                        delete new_node;
+                for (const auto& transition : state->transitions) {
+                    auto next = index[transition.next];
+                    auto status = targets.emplace(next, transitions.size());
+                    if (status.second)
+                        transitions.emplace_back(next);
+                    transitions[status.first->second].characters.add(
+                        boost::icl::construct<boost::icl::discrete_interval<CharType>>(
+                            transition.lower,
+                            transition.upper,
+                            boost::icl::interval_bounds::closed()
+                        )
+                    );
                 }
             }
-            _nodes = set_type(result.begin(), result.end());
-            _initial = initial;
-            aggregate();
+
+            std::vector<int> result;
+            for (auto&& start : dfa_machine.starts())
+                result.push_back(index[start]);
+            return result;
         }
 
         /**
-         * Moore's algorithm for DFA state minimization. Identifies all the
-         * indistinguishable subsets of
-         * DFA states and replaces them with a single state.
+         * Builds the automaton without the literal productions and checks for
+         * every literal which production accepts it in that automaton. If it is
+         * accepted by a production with lower precedence than the literal, it
+         * is moved to the keyword table, otherwise it is put back into the
+         * automaton.
+         *
+         * The keyword table is looked up in every mode, so with several modes a
+         * word is only moved there if it is the same literal in every mode that
+         * has it as a literal, and the productions accepting it in the other
+         * modes do not look keywords up.
          */
-        void optimize() {
-            // Compilers: Principles, Techniques and Tools SE, page 182
-            std::unordered_set<set_type, dfa_set_hash, dfa_set_eq> Gamma, newGamma;
-            std::unordered_map<node_type*, const set_type*> Map, newMap;
-            set_type newG;
-
-            // Create the initial partition - to accepting and non-accepting states
-            Gamma.insert(_nodes);
-            bool initialPartition = true;
-
-            // Refine partitions until there are no more changes.
-            while (true) {
-                for (auto G : Gamma) // Copy
-                {
-                    while (!G.empty()) {
-                        newG.clear();
-                        node_type* pivot = nullptr;
-
-                        for (auto it = G.begin(); it != G.end();) {
-                            bool equiv;
-                            if (pivot == nullptr)
-                                pivot = *it;
-
-                            // Initial partition is made by grouping all the terminal states
-                            // emiting the same token type (all non-terminals also together).
-                            if (initialPartition)
-                                equiv = (pivot->terminal() == (*it)->terminal()) &&
-                                        (pivot->get_terminal() == (*it)->get_terminal());
-                            else
-                                equiv = check_equivalence(pivot, *it, Map);
-
-                            if (equiv) {
-                                newG.insert(*it);
-                                G.erase(it++);
-                            } else {
-                                ++it;
-                            }
-                        }
+        std::vector<int> build_classified(
+            std::vector<lexer_node_type>& nodes,
+            keyword_table_type& keywords
+        ) {
+            auto mode_count = modes();
+            std::vector<terminal_node_type> rest;
+
+            // The literal with the highest precedence of every word in each mode.
+            std::map<std::basic_string<CharType>, std::vector<const token_info_type*>> literals;
+            std::map<int, uint64_t> masks;
+
+            auto add_literal = [&](const std::basic_string<CharType>& word,
+                                   const token_info_type& token,
+                                   uint64_t mask) {
+                auto& best = literals[word];
+                best.resize(mode_count, nullptr);
+                for (size_t mode = 0; mode < mode_count; ++mode) {
+                    if (((mask >> mode) & 1) != 0 && (best[mode] == nullptr || token < *best[mode]))
+                        best[mode] = &token;
+                }
+                masks[token.precedence] = mask;
+            };
+
+            for (auto&& production : productions) {
+                std::vector<std::basic_string<CharType>> words;
+                auto regex = arena.simplify(arena.parse(production.regex));
+                if (!finite_language(arena, regex, words, max_keywords)) {
+                    rest.push_back(production);
+                    continue;
+                }
+                for (auto&& word : words)
+                    add_literal(word, production.token, production.modes);
+            }
+            for (auto&& dictionary : dictionaries) {
+                for (auto&& word : dictionary.words)
+                    add_literal(word, dictionary.token, dictionary.modes);
+            }
 
-                        auto subset = &*newGamma.insert(newG).first;
+            auto starts = build(rest, {}, nodes);
 
-                        for (auto it = newG.begin(); it != newG.end(); ++it) {
-                            newMap.emplace(*it, subset);
-                        }
+            auto walk = [&nodes](int start, const std::basic_string<CharType>& word) {
+                const lexer_node_type* node = &nodes[start];
+                for (auto&& ch : word) {
+                    const lexer_node_type* next = nullptr;
+                    for (auto&& transition : node->transitions) {
+                        if (boost::icl::contains(transition.characters, ch))
+                            next = &nodes[transition.next];
                     }
+                    if ((node = next) == nullptr)
+                        break;
                 }
+                return node;
+            };
+
+            struct candidate {
+                const token_info_type* token;
+                std::vector<int> hosts;
+                std::vector<int> others;
+            };
+            std::map<std::basic_string<CharType>, candidate> candidates;
+            std::unordered_set<int> hosts;
+            std::map<int, dictionary_node_type> remaining;
+
+            auto put_back = [&](const std::basic_string<CharType>& word) {
+                for (auto&& token : literals[word]) {
+                    if (token == nullptr)
+                        continue;
+                    auto& words =
+                        remaining
+                            .emplace(
+                                token->precedence,
+                                dictionary_node_type(*token, {}, masks[token->precedence])
+                            )
+                            .first->second.words;
+                    if (words.empty() || words.back() != word)
+                        words.push_back(word);
+                }
+            };
+
+            for (auto&& literal : literals) {
+                candidate current{ nullptr, {}, {} };
+                bool keyword = !literal.first.empty();
+                for (size_t mode = 0; keyword && mode < mode_count; ++mode) {
+                    auto node = walk(starts[mode], literal.first);
+                    auto token = literal.second[mode];
+                    if (token == nullptr) {
+                        if (node != nullptr && node->terminal)
+                            current.others.push_back(node->production);
+                        continue;
+                    }
 
-                initialPartition = false;
-
-                if (newGamma.size() == Gamma.size())
-                    break;
-                else {
-                    newGamma.swap(Gamma);
-                    newMap.swap(Map);
+                    keyword = (current.token == nullptr || *current.token == *token) &&
+                              node != nullptr && node->terminal &&
+                              token->precedence < node->production;
+                    current.token = token;
+                    if (keyword)
+                        current.hosts.push_back(node->production);
+                }
 
-                    newGamma.clear();
-                    newMap.clear();
+                if (!keyword) {
+                    put_back(literal.first);
+                    continue;
                 }
+                hosts.insert(current.hosts.begin(), current.hosts.end());
+                candidates.emplace(literal.first, current);
             }
 
-            set_type dead_states;
-
-            _initial = *newMap.at(_initial)->begin();
-
-            for (auto& node : _nodes) {
-                for (auto& transitions : node->transitions) {
-                    auto& equiv_class = *newMap.at(transitions.next);
-                    auto it = equiv_class.begin();
-                    transitions.next = *it;
-                    while (++it != equiv_class.end()) {
-                        dead_states.insert(*it);
-                    }
+            // Productions that would look the word up where it is no keyword keep
+            // it in the automaton. Fewer productions may look keywords up in the
+            // end, so this is only conservative.
+            std::unordered_set<int> reclassified;
+            for (auto&& entry : candidates) {
+                auto& current = entry.second;
+                bool keyword = true;
+                for (auto&& other : current.others)
+                    keyword = keyword && hosts.count(other) == 0;
+
+                if (!keyword) {
+                    put_back(entry.first);
+                    continue;
                 }
+                keywords.add(
+                    entry.first, current.token->precedence, current.token->additional_info
+                );
+                reclassified.insert(current.hosts.begin(), current.hosts.end());
             }
 
-            for (auto& node : dead_states) {
-                _nodes.erase(node);
-                delete node;
+            if (!remaining.empty()) {
+                std::vector<dictionary_node_type> literal_dictionaries;
+                for (auto&& dictionary : remaining)
+                    literal_dictionaries.push_back(dictionary.second);
+
+                nodes.clear();
+                starts = build(rest, literal_dictionaries, nodes);
             }
 
-            aggregate();
-        }
+            for (auto&& node : nodes)
+                node.keywords = node.terminal && reclassified.count(node.production) != 0;
 
-        const node_type* start() const {
-            return _initial;
+            keywords.build();
+            return starts;
         }
-        const set_type& states() const {
-            return _nodes;
+
+        /* Additional info of the production (or dictionary) with the given
+         * precedence. */
+        const AdditionalInfo& production_info(int precedence) const {
+            for (auto&& production : productions) {
+                if (production.token.precedence == precedence)
+                    return production.token.additional_info;
+            }
+            for (auto&& dictionary : dictionaries) {
+                if (dictionary.token.precedence == precedence)
+                    return dictionary.token.additional_info;
+            }
+            throw std::runtime_error("Invalid lexer.");
         }
 
-        ~dfa() {
-            for (auto node : _nodes)
-                delete node;
+        static void check_modes(uint64_t modes) {
+            if (modes == 0)
+                throw std::invalid_argument("Productions have to be matched in some mode.");
         }
-    };
 
-    template <typename AdditionalInfo>
-    struct basic_token_info {
-        int precedence;
-        AdditionalInfo additional_info;
+      public:
+        lexer_generator() : seq_number(0){};
 
-        friend bool operator<(const basic_token_info& lhs, const basic_token_info& rhs) {
-            return (lhs.precedence < rhs.precedence);
-        }
+        /**
+         * nfa_construction::position builds the epsilon-free position automaton
+         * instead of Thompson's construction, which gives far fewer NFA states and
+         * spares the subset construction from computing epsilon-closures.
+         */
+        explicit lexer_generator(nfa_construction construction_) : seq_number(0) {
+            options.construction = construction_;
+        };
 
-        friend bool operator==(const basic_token_info& lhs1, const basic_token_info& rhs1) {
-            return lhs1.precedence == rhs1.precedence;
-        }
+        explicit lexer_generator(const lexer_options& options_)
+          : seq_number(0), options(options_){};
 
-        friend bool operator!=(const basic_token_info& lhs1, const basic_token_info& rhs1) {
-            return !(lhs1 == rhs1);
+        /**
+         * Copies the grammar and options, but not the state kept for incremental
+         * generation, so that copies can be generated concurrently.
+         */
+        lexer_generator(const lexer_generator& other)
+          : productions(other.productions),
+            dictionaries(other.dictionaries),
+            seq_number(other.seq_number),
+            options(other.options),
+            arena(other.arena),
+            last_reduction(other.last_reduction) {
         }
-    };
 
-    template <typename CharType, typename AdditionalInfo>
-    struct lexer_transition {
-        boost::icl::interval_set<CharType> characters;
-        size_t next;
+        lexer_generator(lexer_generator&&) = default;
 
-        explicit lexer_transition(size_t next_) : next(next_) {
-        }
-        lexer_transition(boost::icl::interval_set<CharType> characters_, size_t next_)
-          : characters(characters_), next(next_) {
+        lexer_generator& operator=(const lexer_generator& other) {
+            return *this = lexer_generator(other);
         }
-    };
 
-    template <typename CharType, typename AdditionalInfo>
-    struct lexer_node {
-        std::vector<lexer_transition<CharType, AdditionalInfo>> transitions;
+        lexer_generator& operator=(lexer_generator&&) = default;
 
-        bool terminal;
-        AdditionalInfo terminal_info;
+        friend lexer_generator& operator<<(
+            lexer_generator& lhs,
+            const lexer_production<CharType, AdditionalInfo>& terminal
+        ) {
+            check_modes(terminal.modes);
+            token_info_type info;
+            info.precedence = lhs.seq_number++;
+            info.additional_info = terminal.node;
+            lhs.productions.emplace_back(terminal_node_type(info, terminal.regex, terminal.modes));
+            return lhs;
+        }
 
-        lexer_node(const dfa_node<CharType, basic_token_info<AdditionalInfo>>& node)
-          : terminal(node.terminal()), terminal_info(node.get_terminal().additional_info) {
+        friend lexer_generator& operator<<(
+            lexer_generator& lhs,
+            const lexer_dictionary<CharType, AdditionalInfo>& dictionary
+        ) {
+            check_modes(dictionary.modes);
+            token_info_type info;
+            info.precedence = lhs.seq_number++;
+            info.additional_info = dictionary.node;
+            lhs.dictionaries.emplace_back(
+                dictionary_node_type(info, dictionary.words, dictionary.modes)
+            );
+            return lhs;
         }
-    };
 
-    template <typename CharType, typename AdditionalInfo>
-    class lexer {
-        using lexer_node_type = lexer_node<CharType, AdditionalInfo>;
-        std::vector<lexer_node_type> _states;
-        int _start;
+        /**
+         * Replaces the production with the given number (productions and
+         * dictionaries are numbered in the order they were added), keeping its
+         * precedence.
+         */
+        void replace(int number, const lexer_production<CharType, AdditionalInfo>& terminal) {
+            check_modes(terminal.modes);
+            for (auto&& production : productions) {
+                if (production.token.precedence == number) {
+                    production.token.additional_info = terminal.node;
+                    production.regex = terminal.regex;
+                    production.modes = terminal.modes;
+                    return;
+                }
+            }
+            throw std::out_of_range("No production with this number.");
+        }
 
-      public:
-        template <typename Iterator>
-        lexer(Iterator begin, Iterator end, int start) : _states(begin, end), _start(start) {
+        void replace(int number, const lexer_dictionary<CharType, AdditionalInfo>& dictionary) {
+            check_modes(dictionary.modes);
+            for (auto&& existing : dictionaries) {
+                if (existing.token.precedence == number) {
+                    existing.token.additional_info = dictionary.node;
+                    existing.words = dictionary.words;
+                    existing.modes = dictionary.modes;
+                    return;
+                }
+            }
+            throw std::out_of_range("No dictionary with this number.");
         }
 
-        const std::vector<lexer_node_type>& states() const {
-            return _states;
+        /**
+         * Canonical text of everything the generated lexer depends on: the
+         * version of the library's regex syntax, the character type, the options
+         * and the productions and dictionaries with their precedence, but not
+         * their additional info. Generators with the same text generate the same
+         * lexer, up to the additional info.
+         */
+        std::string canonical_grammar() const {
+            auto number = [](int64_t value) { return " " + std::to_string(value); };
+            auto word = [&number](const std::basic_string<CharType>& text) {
+                auto result = number(static_cast<int64_t>(text.size()));
+                for (auto&& ch : text)
+                    result += number(static_cast<int64_t>(ch));
+                return result;
+            };
+
+            // 2 is the version of the format written by lexer::save().
+            std::string result = "supercomplex-grammar" + number(grammar_version) + number(2) +
+                                 number(sizeof(CharType)) +
+                                 number(std::is_signed<CharType>::value) +
+                                 number(static_cast<int64_t>(options.construction)) +
+                                 number(static_cast<int64_t>(options.order)) +
+                                 number(options.classify_keywords) + "\n";
+
+            for (auto&& production : productions) {
+                result += "p" + number(production.token.precedence) +
+                          number(static_cast<int64_t>(production.modes)) +
+                          word(production.regex) + "\n";
+            }
+            for (auto&& dictionary : dictionaries) {
+                result += "d" + number(dictionary.token.precedence) +
+                          number(static_cast<int64_t>(dictionary.modes)) +
+                          number(static_cast<int64_t>(dictionary.words.size())) + "\n";
+                for (auto&& entry : dictionary.words)
+                    result += word(entry) + "\n";
+            }
+            return result;
         }
 
-        int start() const {
-            return _start;
+        /**
+         * 64-bit FNV-1a hash of canonical_grammar(). It is the same on every
+         * platform and run, so it can name a generated lexer saved with
+         * lexer::save(), but different grammars may collide.
+         */
+        uint64_t fingerprint() const {
+            uint64_t hash = 14695981039346656037ull;
+            for (auto&& ch : canonical_grammar())
+                hash = (hash ^ static_cast<unsigned char>(ch)) * 1099511628211ull;
+            return hash;
         }
-    };
 
-    template <typename CharType, typename AdditionalInfo>
-    struct lexer_production {
-        std::basic_string<CharType> regex;
-        AdditionalInfo node;
+        /**
+         * Reads a lexer written by lexer::save() that was generated from this
+         * grammar (see fingerprint()), with the additional info of the current
+         * productions. Throws std::runtime_error if the input is not valid.
+         */
+        lexer<CharType, AdditionalInfo> load(std::istream& in) const {
+            std::string magic;
+            int version = 0;
+            size_t size = 0, mode_count = 1;
+            in >> magic >> version >> size;
+            if (version == 2)
+                in >> mode_count;
+            if (!in || magic != "supercomplex-lexer" || (version != 1 && version != 2) ||
+                mode_count == 0 || mode_count > 64 ||
+                size > static_cast<size_t>(std::numeric_limits<int>::max()))
+                throw std::runtime_error("Invalid lexer.");
+
+            std::vector<int> starts(mode_count);
+            for (auto&& start : starts) {
+                in >> start;
+                if (!in || start < 0 || static_cast<size_t>(start) >= size)
+                    throw std::runtime_error("Invalid lexer.");
+            }
 
-        lexer_production(AdditionalInfo node_, const std::basic_string<CharType>& regex_)
-          : regex(regex_), node(node_){};
-    };
+            auto read_char = [&in]() {
+                int64_t value = 0;
+                in >> value;
+                auto ch = static_cast<CharType>(value);
+                if (!in || static_cast<int64_t>(ch) != value)
+                    throw std::runtime_error("Invalid lexer.");
+                return ch;
+            };
+
+            // The counts are not trusted: the nodes and transitions are only
+            // allocated as they are read, so a damaged input runs out first.
+            std::vector<lexer_node_type> nodes;
+            for (size_t index = 0; index < size; ++index) {
+                nodes.emplace_back();
+                auto& node = nodes.back();
+                size_t transitions = 0;
+                in >> node.production >> node.keywords >> transitions;
+                if (!in || transitions > size)
+                    throw std::runtime_error("Invalid lexer.");
+
+                node.terminal = node.production != -1;
+                if (node.terminal)
+                    node.terminal_info = production_info(node.production);
+
+                for (size_t i = 0; i < transitions; ++i) {
+                    size_t next = 0, intervals = 0;
+                    in >> next >> intervals;
+                    if (!in || next >= size)
+                        throw std::runtime_error("Invalid lexer.");
+
+                    node.transitions.emplace_back(next);
+                    for (size_t j = 0; j < intervals; ++j) {
+                        auto lower = read_char();
+                        auto upper = read_char();
+                        node.transitions.back().characters.add(
+                            boost::icl::construct<boost::icl::discrete_interval<CharType>>(
+                                lower, upper, boost::icl::interval_bounds::closed()
+                            )
+                        );
+                    }
+                }
+            }
 
-    template <typename CharType, typename AdditionalInfo>
-    class lexer_generator {
-        using token_info_type = basic_token_info<AdditionalInfo>;
-        using terminal_node_type = terminal_node<CharType, token_info_type>;
+            keyword_table_type keywords;
+            std::set<std::basic_string<CharType>> seen;
+            size_t count = 0;
+            in >> count;
+            for (size_t i = 0; in && i < count; ++i) {
+                int production = 0;
+                size_t length = 0;
+                in >> production >> length;
+                std::basic_string<CharType> word;
+                for (size_t j = 0; in && j < length; ++j)
+                    word.push_back(read_char());
+                if (!in)
+                    break;
+                if (!seen.insert(word).second)
+                    throw std::runtime_error("Invalid lexer.");
+                keywords.add(word, production, production_info(production));
+            }
+            if (!in)
+                throw std::runtime_error("Invalid lexer.");
+            keywords.build();
 
-        std::vector<terminal_node_type> productions;
-        int seq_number;
+            return lexer<CharType, AdditionalInfo>(nodes.begin(), nodes.end(), starts, keywords);
+        }
 
-      public:
-        lexer_generator() : seq_number(0){};
+        /**
+         * Number of NFA nodes and transitions before and after nfa::simplify()
+         * in the last call to generate() (the final automaton if keywords are
+         * classified). Both are zero if lexer_options::simplify_nfa is not set.
+         */
+        const nfa_reduction& reduction() const {
+            return last_reduction;
+        }
 
-        friend lexer_generator& operator<<(
-            lexer_generator& lhs,
-            const lexer_production<CharType, AdditionalInfo>& terminal
-        ) {
-            token_info_type info;
-            info.precedence = lhs.seq_number++;
-            info.additional_info = terminal.node;
-            lhs.productions.emplace_back(terminal_node_type(info, terminal.regex));
-            return lhs;
+        /**
+         * Number of modes of the generated lexer, up to the highest one any
+         * production or dictionary is matched in.
+         */
+        size_t modes() const {
+            uint64_t all = 1;
+            for (auto&& production : productions)
+                all |= production.modes;
+            for (auto&& dictionary : dictionaries)
+                all |= dictionary.modes;
+
+            size_t count = 1;
+            while (count < 64 && (all >> count) != 0)
+                ++count;
+            return count;
         }
 
         lexer<CharType, AdditionalInfo> generate() {
-            nfa<CharType, token_info_type> nfa_machine(productions.begin(), productions.end());
-            dfa<CharType, token_info_type> dfa_machine(nfa_machine.start());
-            dfa_machine.optimize();
+            std::vector<lexer_node_type> nodes;
+            keyword_table_type keywords;
 
-            std::vector<lexer_node<CharType, AdditionalInfo>> nodes;
-            std::unordered_map<const dfa_node<CharType, token_info_type>*, int> index;
+            auto starts = options.classify_keywords ? build_classified(nodes, keywords)
+                                                    : build(productions, dictionaries, nodes);
 
-            for (const auto& state : dfa_machine.states()) {
-                index[state] = nodes.size();
-                nodes.emplace_back(*state);
+            return lexer<CharType, AdditionalInfo>(nodes.begin(), nodes.end(), starts, keywords);
+        }
+
+        /**
+         * Generates the lexer with the states renumbered by decreasing number of
+         * visits and the transitions of each state ordered by decreasing number
+         * of uses, so that hot states are contiguous and code generators test
+         * the most frequent transitions first. The profile has to be collected
+         * with a lexer generated by generate() from the same grammar and options.
+         */
+        lexer<CharType, AdditionalInfo> generate(const lexer_profile& profile) {
+            std::vector<lexer_node_type> nodes;
+            keyword_table_type keywords;
+
+            auto starts = options.classify_keywords ? build_classified(nodes, keywords)
+                                                    : build(productions, dictionaries, nodes);
+
+            if (profile.visits.size() != nodes.size())
+                throw std::runtime_error("Profile does not match the grammar.");
+            for (size_t i = 0; i < nodes.size(); ++i) {
+                if (profile.transitions[i].size() != nodes[i].transitions.size())
+                    throw std::runtime_error("Profile does not match the grammar.");
             }
 
-            for (const auto& state : dfa_machine.states()) {
-                for (const auto& transition : state->transitions) {
-                    nodes[index[state]].transitions.emplace_back(
-                        transition.characters, index[transition.next]
-                    );
+            std::vector<size_t> order(nodes.size());
+            for (size_t i = 0; i < order.size(); ++i)
+                order[i] = i;
+            std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+                return profile.visits[a] > profile.visits[b];
+            });
+
+            std::vector<size_t> index(nodes.size());
+            for (size_t i = 0; i < order.size(); ++i)
+                index[order[i]] = i;
+
+            std::vector<lexer_node_type> sorted;
+            for (auto&& i : order) {
+                auto node = nodes[i];
+                const auto& counts = profile.transitions[i];
+                std::vector<size_t> transitions(node.transitions.size());
+                for (size_t j = 0; j < transitions.size(); ++j)
+                    transitions[j] = j;
+                std::stable_sort(transitions.begin(), transitions.end(), [&](size_t a, size_t b) {
+                    return counts[a] > counts[b];
+                });
+
+                node.transitions.clear();
+                for (auto&& j : transitions) {
+                    node.transitions.push_back(nodes[i].transitions[j]);
+                    node.transitions.back().next = index[node.transitions.back().next];
                 }
+                sorted.push_back(std::move(node));
             }
 
-            return lexer<CharType, AdditionalInfo>(
-                nodes.begin(), nodes.end(), index[dfa_machine.start()]
-            );
+            for (auto&& start : starts)
+                start = static_cast<int>(index[static_cast<size_t>(start)]);
+            return lexer<CharType, AdditionalInfo>(sorted.begin(), sorted.end(), starts, keywords);
         }
     };
 } // namespace supercomplex
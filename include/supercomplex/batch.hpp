@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "supercomplex.hpp"
+
+namespace supercomplex {
+    /**
+     * Calls function(i) for every i in [0, count) on up to the given number of
+     * threads (including the calling one). The function must not throw.
+     */
+    template <typename Function>
+    void parallel_for(size_t count, size_t threads, Function function) {
+        std::atomic<size_t> next(0);
+        auto work = [&]() {
+            for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;)
+                function(i);
+        };
+
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < std::min(threads, count); ++i)
+            pool.emplace_back(work);
+        work();
+        for (auto&& thread : pool)
+            thread.join();
+    }
+
+    /**
+     * Outcome of generating one grammar of a batch: the lexer, or the exception
+     * its generation threw.
+     */
+    template <typename CharType, typename AdditionalInfo>
+    struct batch_result {
+        std::unique_ptr<lexer<CharType, AdditionalInfo>> result;
+        std::exception_ptr error;
+
+        explicit operator bool() const {
+            return result != nullptr;
+        }
+    };
+
+    /**
+     * Generates the lexers of many generators (e.g. one grammar per tenant)
+     * concurrently on the given number of threads, with the results in the
+     * order of the generators. Generators with the same canonical_grammar()
+     * differ at most in the additional info of their productions, so only the
+     * first of them is generated and the others load its saved automaton with
+     * their own additional info. An error in one grammar (typically an invalid
+     * regex) does not affect the others, it is stored in its result, and so are
+     * the results of the generators sharing it.
+     */
+    template <typename CharType, typename AdditionalInfo>
+    std::vector<batch_result<CharType, AdditionalInfo>> generate_batch(
+        std::vector<lexer_generator<CharType, AdditionalInfo>>& generators,
+        size_t threads = std::max(1u, std::thread::hardware_concurrency())
+    ) {
+        using lexer_type = lexer<CharType, AdditionalInfo>;
+
+        // The first generator with each grammar is generated, the others copy
+        // its automaton. Grammars are compared in full, as fingerprints may
+        // collide.
+        std::vector<size_t> leaders, source(generators.size());
+        std::unordered_map<std::string, size_t> groups;
+        for (size_t i = 0; i < generators.size(); ++i) {
+            auto status = groups.emplace(generators[i].canonical_grammar(), i);
+            if (status.second)
+                leaders.push_back(i);
+            source[i] = status.first->second;
+        }
+
+        std::vector<batch_result<CharType, AdditionalInfo>> results(generators.size());
+        std::vector<std::string> saved(generators.size());
+
+        parallel_for(leaders.size(), threads, [&](size_t i) {
+            auto& result = results[leaders[i]];
+            try {
+                result.result.reset(new lexer_type(generators[leaders[i]].generate()));
+                if (leaders.size() != generators.size()) {
+                    std::ostringstream out;
+                    result.result->save(out);
+                    saved[leaders[i]] = out.str();
+                }
+            } catch (...) {
+                result.result.reset();
+                result.error = std::current_exception();
+            }
+        });
+
+        parallel_for(generators.size(), threads, [&](size_t i) {
+            auto& leader = results[source[i]];
+            if (source[i] == i)
+                return;
+            if (!leader) {
+                results[i].error = leader.error;
+                return;
+            }
+            try {
+                std::istringstream in(saved[source[i]]);
+                results[i].result.reset(new lexer_type(generators[i].load(in)));
+            } catch (...) {
+                results[i].error = std::current_exception();
+            }
+        });
+
+        return results;
+    }
+} // namespace supercomplex
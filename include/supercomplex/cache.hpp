@@ -0,0 +1,158 @@
+#pragma once
+
+#if __cplusplus < 201703L
+#error "supercomplex/cache.hpp requires C++17."
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <vector>
+
+#include "supercomplex.hpp"
+
+namespace supercomplex {
+    /**
+     * Directory of generated lexers named after the fingerprint of their grammar
+     * (see lexer_generator::fingerprint()), so that a grammar generated before,
+     * by any process sharing the directory, is loaded instead of generated
+     * again. Every entry starts with the canonical grammar it was generated
+     * from, and an entry of another grammar with the same fingerprint is a miss.
+     *
+     * Entries are written to a temporary file and renamed into place, so readers
+     * never see a partial entry. Loading an entry marks it as recently used, and
+     * once the entries take more than the capacity, the least recently used ones
+     * are removed. Failing to write an entry is not an error, the generated
+     * lexer is returned anyway, and an entry that cannot be read is replaced.
+     */
+    class lexer_cache {
+        std::filesystem::path _directory;
+        uintmax_t _capacity;
+
+        static constexpr const char* extension = ".lexer";
+
+        std::filesystem::path entry(uint64_t key) const {
+            static const char digits[] = "0123456789abcdef";
+            std::string name(16, '0');
+            for (size_t i = 0; i < name.size(); ++i)
+                name[name.size() - 1 - i] = digits[(key >> (4 * i)) & 15];
+            return _directory / (name + extension);
+        }
+
+        /* Reads the grammar at the start of an entry and checks that it is the
+         * given one. */
+        static bool matches(std::istream& in, const std::string& grammar) {
+            size_t size = 0;
+            in >> size;
+            if (!in || in.get() != '\n' || size != grammar.size())
+                return false;
+
+            std::string stored(size, '\0');
+            in.read(&stored[0], static_cast<std::streamsize>(size));
+            return in && stored == grammar;
+        }
+
+        void store(const std::filesystem::path& file, const std::string& contents) const {
+            std::random_device random;
+            auto temporary = file;
+            temporary += "." + std::to_string(random()) + std::to_string(random()) + ".tmp";
+
+            std::error_code error;
+            {
+                std::ofstream out(temporary, std::ios::binary);
+                out << contents;
+                if (!out)
+                    error = std::make_error_code(std::errc::io_error);
+            }
+            if (!error)
+                std::filesystem::rename(temporary, file, error);
+            if (error)
+                std::filesystem::remove(temporary, error);
+        }
+
+        /* Removes the least recently used entries until the rest fit. Entries
+         * removed concurrently by other processes are skipped. */
+        void evict() const {
+            using entry_type =
+                std::tuple<std::filesystem::file_time_type, uintmax_t, std::filesystem::path>;
+            std::vector<entry_type> entries;
+            uintmax_t total = 0;
+
+            std::error_code error;
+            for (std::filesystem::directory_iterator it(_directory, error), end;
+                 !error && it != end;
+                 it.increment(error)) {
+                if (it->path().extension() != extension)
+                    continue;
+                std::error_code entry_error;
+                auto size = it->file_size(entry_error);
+                auto time = it->last_write_time(entry_error);
+                if (entry_error)
+                    continue;
+                entries.emplace_back(time, size, it->path());
+                total += size;
+            }
+
+            std::sort(entries.begin(), entries.end());
+            for (auto&& entry : entries) {
+                if (total <= _capacity)
+                    break;
+                std::filesystem::remove(std::get<2>(entry), error);
+                total -= std::get<1>(entry);
+            }
+        }
+
+      public:
+        explicit lexer_cache(std::filesystem::path directory, uintmax_t capacity = 64 << 20)
+          : _directory(std::move(directory)), _capacity(capacity) {
+            std::filesystem::create_directories(_directory);
+        }
+
+        /**
+         * Returns the lexer of the generator's grammar from the cache, or
+         * generates and stores it.
+         */
+        template <typename CharType, typename AdditionalInfo>
+        lexer<CharType, AdditionalInfo>
+        generate(lexer_generator<CharType, AdditionalInfo>& generator) {
+            auto grammar = generator.canonical_grammar();
+            auto file = entry(generator.fingerprint());
+
+            std::ifstream in(file, std::ios::binary);
+            if (in && matches(in, grammar)) {
+                try {
+                    auto result = generator.load(in);
+                    std::error_code error;
+                    std::filesystem::last_write_time(
+                        file, std::filesystem::file_time_type::clock::now(), error
+                    );
+                    return result;
+                } catch (const std::exception&) {
+                    // Any failure to read the entry (even std::bad_alloc) makes
+                    // it a miss, and the entry is replaced.
+                }
+            }
+            in.close();
+
+            auto result = generator.generate();
+            std::ostringstream out;
+            out << grammar.size() << '\n' << grammar;
+            result.save(out);
+            store(file, out.str());
+            evict();
+            return result;
+        }
+
+        const std::filesystem::path& directory() const {
+            return _directory;
+        }
+    };
+} // namespace supercomplex
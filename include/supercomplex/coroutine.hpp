@@ -0,0 +1,228 @@
+#pragma once
+
+#if !defined(__cpp_impl_coroutine)
+#error "supercomplex/coroutine.hpp requires C++20 coroutines."
+#endif
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+
+#include "supercomplex.hpp"
+
+namespace supercomplex {
+    /**
+     * Minimal lazily evaluated generator coroutine, iterated with a range-based
+     * for loop. Exceptions thrown in the coroutine propagate from begin() and
+     * from incrementing the iterator.
+     */
+    template <typename T>
+    class generator {
+      public:
+        struct promise_type {
+            const T* value;
+            std::exception_ptr error;
+
+            generator get_return_object() {
+                return generator(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend() noexcept {
+                return {};
+            }
+
+            std::suspend_always final_suspend() noexcept {
+                return {};
+            }
+
+            std::suspend_always yield_value(const T& value_) noexcept {
+                value = std::addressof(value_);
+                return {};
+            }
+
+            void return_void() noexcept {
+            }
+
+            void unhandled_exception() {
+                error = std::current_exception();
+            }
+        };
+
+        class iterator {
+            std::coroutine_handle<promise_type> _handle;
+
+          public:
+            using value_type = T;
+            using difference_type = std::ptrdiff_t;
+
+            iterator() = default;
+
+            explicit iterator(std::coroutine_handle<promise_type> handle) : _handle(handle) {
+            }
+
+            const T& operator*() const {
+                return *_handle.promise().value;
+            }
+
+            const T* operator->() const {
+                return _handle.promise().value;
+            }
+
+            iterator& operator++() {
+                _handle.resume();
+                if (_handle.promise().error)
+                    std::rethrow_exception(_handle.promise().error);
+                return *this;
+            }
+
+            void operator++(int) {
+                ++*this;
+            }
+
+            friend bool operator==(const iterator& it, std::default_sentinel_t) {
+                return it._handle.done();
+            }
+        };
+
+      private:
+        std::coroutine_handle<promise_type> _handle;
+
+        explicit generator(std::coroutine_handle<promise_type> handle) : _handle(handle) {
+        }
+
+      public:
+        generator(generator&& other) noexcept : _handle(std::exchange(other._handle, {})) {
+        }
+
+        generator& operator=(generator&& other) noexcept {
+            std::swap(_handle, other._handle);
+            return *this;
+        }
+
+        generator(const generator&) = delete;
+        generator& operator=(const generator&) = delete;
+
+        iterator begin() {
+            _handle.resume();
+            if (_handle.promise().error)
+                std::rethrow_exception(_handle.promise().error);
+            return iterator(_handle);
+        }
+
+        std::default_sentinel_t end() {
+            return {};
+        }
+
+        ~generator() {
+            if (_handle)
+                _handle.destroy();
+        }
+    };
+
+    /**
+     * Tokenizes the input lazily. The lexer and the input have to outlive the
+     * generator. Throws std::runtime_error on input that no token matches.
+     */
+    template <typename CharType, typename AdditionalInfo>
+    generator<lexer_token<CharType>>
+    tokens(const lexer<CharType, AdditionalInfo>& lexer_, const CharType* input, size_t size) {
+        lexer_token<CharType> token;
+        size_t offset = 0;
+
+        while (offset < size) {
+            auto length = lexer_.match(input + offset, input + size, token.production);
+            if (length == 0)
+                throw std::runtime_error("Invalid input.");
+
+            token.offset = offset;
+            token.value.assign(input + offset, length);
+            co_yield token;
+            offset += length;
+        }
+    }
+
+    /**
+     * Tokenizes input that is read asynchronously. A coroutine awaits tokens
+     * with `co_await lexer.next()`, which gives an empty optional at the end of
+     * the input and throws std::runtime_error on input that no token matches.
+     * When the buffered input runs out, the coroutine is suspended until the
+     * reader passes the next chunk to feed() or signals the end of the input
+     * with close(); these resume the coroutine as soon as a token is complete.
+     * A chunk has to stay valid until the lexer is waiting() again.
+     */
+    template <typename CharType, typename AdditionalInfo>
+    class async_lexer {
+        lexer_stream<CharType, AdditionalInfo> _stream;
+        lexer_token<CharType> _token;
+        bool _has_token;
+        std::coroutine_handle<> _waiting;
+
+        bool poll() {
+            _has_token = _stream.next(_token);
+            return _has_token || _stream.finished() || _stream.failed();
+        }
+
+        void resume() {
+            if (_waiting && poll())
+                std::exchange(_waiting, {}).resume();
+        }
+
+        struct token_awaiter {
+            async_lexer& owner;
+
+            bool await_ready() {
+                return owner.poll();
+            }
+
+            void await_suspend(std::coroutine_handle<> handle) {
+                owner._waiting = handle;
+            }
+
+            std::optional<lexer_token<CharType>> await_resume() {
+                if (owner._has_token)
+                    return std::move(owner._token);
+                if (owner._stream.failed())
+                    throw std::runtime_error("Invalid input.");
+                return std::nullopt;
+            }
+        };
+
+      public:
+        explicit async_lexer(const lexer<CharType, AdditionalInfo>& lexer_)
+          : _stream(lexer_), _has_token(false) {
+        }
+
+        token_awaiter next() {
+            return token_awaiter{ *this };
+        }
+
+        void feed(const CharType* chunk, size_t size) {
+            _stream.feed(chunk, size);
+            resume();
+        }
+
+        void close() {
+            _stream.close();
+            resume();
+        }
+
+        /**
+         * Switches to the mode from the next token on, see lexer_stream::mode().
+         */
+        void mode(size_t mode) {
+            _stream.mode(mode);
+        }
+
+        /**
+         * Whether a coroutine is suspended waiting for more input.
+         */
+        bool waiting() const {
+            return static_cast<bool>(_waiting);
+        }
+    };
+} // namespace supercomplex
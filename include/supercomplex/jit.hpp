@@ -0,0 +1,442 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "supercomplex.hpp"
+
+#if defined(__x86_64__) && defined(__linux__)
+#define SUPERCOMPLEX_JIT 1
+#include <sys/mman.h>
+#endif
+
+namespace supercomplex {
+#if defined(SUPERCOMPLEX_JIT)
+    /**
+     * Just enough of an x86-64 assembler to emit the code of a DFA: a byte
+     * buffer, labels, and rel32 jumps patched once all labels are bound.
+     */
+    class x86_assembler {
+        std::vector<uint8_t> _code;
+        std::vector<ptrdiff_t> _labels;
+        std::vector<std::pair<size_t, size_t>> _fixups;
+
+      public:
+        enum reg { rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11 };
+        enum condition { below = 0x2, above_equal = 0x3, equal = 0x4, not_equal = 0x5,
+                         below_equal = 0x6 };
+
+        size_t label() {
+            _labels.push_back(-1);
+            return _labels.size() - 1;
+        }
+
+        void bind(size_t label) {
+            _labels[label] = static_cast<ptrdiff_t>(_code.size());
+        }
+
+        void byte(uint8_t value) {
+            _code.push_back(value);
+        }
+
+        void bytes(std::initializer_list<uint8_t> values) {
+            _code.insert(_code.end(), values);
+        }
+
+        void imm32(uint32_t value) {
+            for (int i = 0; i < 4; ++i)
+                byte(static_cast<uint8_t>(value >> (8 * i)));
+        }
+
+        void rel32(size_t label) {
+            _fixups.emplace_back(_code.size(), label);
+            imm32(0);
+        }
+
+        /* mov dst, src (64-bit) */
+        void mov(reg dst, reg src) {
+            byte(0x48 | (src >= 8 ? 0x4 : 0) | (dst >= 8 ? 0x1 : 0));
+            byte(0x89);
+            byte(0xC0 | ((src & 7) << 3) | (dst & 7));
+        }
+
+        /* mov dst, imm32 (32-bit, zero extended) */
+        void mov32(reg dst, uint32_t value) {
+            if (dst >= 8)
+                byte(0x41);
+            byte(0xB8 | (dst & 7));
+            imm32(value);
+        }
+
+        /* op dst, src (64-bit) for add (0x01), sub (0x29) and cmp (0x39) */
+        void arith(uint8_t opcode, reg dst, reg src) {
+            byte(0x48 | (src >= 8 ? 0x4 : 0) | (dst >= 8 ? 0x1 : 0));
+            byte(opcode);
+            byte(0xC0 | ((src & 7) << 3) | (dst & 7));
+        }
+
+        /* op dst, imm8 (64-bit) with the /digit of add (0), sub (5) or cmp (7) */
+        void arith_imm8(uint8_t digit, reg dst, int8_t value) {
+            byte(0x48 | (dst >= 8 ? 0x1 : 0));
+            byte(0x83);
+            byte(0xC0 | (digit << 3) | (dst & 7));
+            byte(static_cast<uint8_t>(value));
+        }
+
+        void jump(size_t label) {
+            byte(0xE9);
+            rel32(label);
+        }
+
+        void jump(condition cc, size_t label) {
+            bytes({ 0x0F, static_cast<uint8_t>(0x80 | cc) });
+            rel32(label);
+        }
+
+        /* 66 [REX] 0F op /r on two xmm registers */
+        void sse(uint8_t opcode, int dst, int src) {
+            byte(0x66);
+            if (dst >= 8 || src >= 8)
+                byte(0x40 | (dst >= 8 ? 0x4 : 0) | (src >= 8 ? 0x1 : 0));
+            bytes({ 0x0F, opcode, static_cast<uint8_t>(0xC0 | ((dst & 7) << 3) | (src & 7)) });
+        }
+
+        /* Sets the xmm register to the byte repeated 16 times (clobbers eax). */
+        void broadcast(int xmm, uint8_t value) {
+            mov32(rax, value * 0x01010101u);
+            sse(0x6E, xmm, rax); // movd xmm, eax
+            sse(0x70, xmm, xmm); // pshufd xmm, xmm, 0
+            byte(0x00);
+        }
+
+        std::vector<uint8_t> finish() {
+            for (auto&& fixup : _fixups) {
+                auto target = _labels[fixup.second];
+                if (target < 0)
+                    throw std::runtime_error("Unbound label.");
+                auto offset =
+                    static_cast<int32_t>(target - static_cast<ptrdiff_t>(fixup.first + 4));
+                std::memcpy(&_code[fixup.first], &offset, 4);
+            }
+            return _code;
+        }
+    };
+#endif
+
+    /**
+     * Compiles a lexer for single byte characters into native x86-64 code
+     * (Linux only). Every state becomes a block of code that dispatches on the
+     * next byte with comparisons and jumps, and states with a self-loop on a
+     * few ranges of bytes skip over them 16 bytes at a time with SSE2. On other
+     * platforms, for wider characters, or if executable memory cannot be
+     * mapped, match() and tokenize() use the lexer's tables instead.
+     *
+     * The lexer has to outlive the compiled code.
+     */
+    template <typename CharType, typename AdditionalInfo>
+    class jit_lexer {
+        using lexer_type = lexer<CharType, AdditionalInfo>;
+        using scan_function = const uint8_t* (*)(const uint8_t*, const uint8_t*, int*);
+
+        // Self-loops on more ranges than this are scanned one byte at a time.
+        static constexpr size_t max_simd_ranges = 3;
+
+        const lexer_type& _lexer;
+        void* _memory;
+        size_t _size;
+        scan_function _scan;
+
+        jit_lexer(const jit_lexer&) = delete;
+        jit_lexer& operator=(const jit_lexer&) = delete;
+
+#if defined(SUPERCOMPLEX_JIT)
+        struct byte_range {
+            unsigned lower;
+            unsigned upper;
+            int next;
+        };
+
+        /* Transitions of the state over unsigned bytes, which do not order like
+         * the characters if CharType is signed. */
+        std::vector<byte_range> ranges(int state) const {
+            std::vector<byte_range> result;
+            for (unsigned ch = 0; ch < 256; ++ch) {
+                auto character = static_cast<CharType>(static_cast<unsigned char>(ch));
+                int next = _lexer.next(state, character);
+                if (!result.empty() && result.back().next == next && result.back().upper + 1 == ch)
+                    result.back().upper = ch;
+                else
+                    result.push_back({ ch, ch, next });
+            }
+            std::vector<byte_range> transitions;
+            for (auto&& range : result) {
+                if (range.next != -1)
+                    transitions.push_back(range);
+            }
+            return transitions;
+        }
+
+        /* Jumps to the state of the range containing the byte in eax, or to
+         * done if there is none, with a binary search over the ranges. */
+        void dispatch(
+            x86_assembler& assembler,
+            const std::vector<byte_range>& transitions,
+            size_t first,
+            size_t last,
+            const std::vector<size_t>& states,
+            size_t done
+        ) {
+            using asm_t = x86_assembler;
+            if (last - first > 4) {
+                auto middle = first + (last - first) / 2;
+                auto upper = assembler.label();
+                assembler.bytes({ 0x3D }); // cmp eax, imm32
+                assembler.imm32(transitions[middle].lower);
+                assembler.jump(asm_t::above_equal, upper);
+                dispatch(assembler, transitions, first, middle, states, done);
+                assembler.bind(upper);
+                dispatch(assembler, transitions, middle, last, states, done);
+                return;
+            }
+
+            for (size_t i = first; i < last; ++i) {
+                auto& range = transitions[i];
+                auto target = states[range.next];
+                if (range.lower == range.upper) {
+                    assembler.bytes({ 0x3D }); // cmp eax, imm32
+                    assembler.imm32(range.lower);
+                    assembler.jump(asm_t::equal, target);
+                } else {
+                    assembler.bytes({ 0x89, 0xC1 }); // mov ecx, eax
+                    assembler.bytes({ 0x81, 0xE9 }); // sub ecx, imm32
+                    assembler.imm32(range.lower);
+                    assembler.bytes({ 0x81, 0xF9 }); // cmp ecx, imm32
+                    assembler.imm32(range.upper - range.lower);
+                    assembler.jump(asm_t::below_equal, target);
+                }
+            }
+            assembler.jump(done);
+        }
+
+        /* Skips over the bytes of a self-loop 16 at a time: a byte is in the
+         * range [lower, upper] iff min(byte - lower, upper - lower) is equal to
+         * byte - lower (unsigned). */
+        void self_loop(
+            x86_assembler& assembler,
+            const std::vector<byte_range>& loop,
+            bool accepting,
+            size_t scalar
+        ) {
+            using asm_t = x86_assembler;
+            for (size_t i = 0; i < loop.size(); ++i) {
+                int lower = static_cast<int>(4 + 2 * i);
+                assembler.broadcast(lower, static_cast<uint8_t>(loop[i].lower));
+                assembler.broadcast(lower + 1, static_cast<uint8_t>(loop[i].upper - loop[i].lower));
+            }
+
+            auto head = assembler.label();
+            assembler.bind(head);
+            assembler.mov(asm_t::rax, asm_t::rsi);
+            assembler.arith(0x29, asm_t::rax, asm_t::rdi); // sub rax, rdi
+            assembler.arith_imm8(7, asm_t::rax, 16);       // cmp rax, 16
+            assembler.jump(asm_t::below, scalar);
+            assembler.bytes({ 0xF3, 0x0F, 0x6F, 0x07 }); // movdqu xmm0, [rdi]
+
+            for (size_t i = 0; i < loop.size(); ++i) {
+                int lower = static_cast<int>(4 + 2 * i);
+                int width = lower + 1;
+                assembler.sse(0x6F, 1, 0);     // movdqa xmm1, xmm0
+                assembler.sse(0xF8, 1, lower); // psubb xmm1, lower
+                assembler.sse(0x6F, 2, 1);     // movdqa xmm2, xmm1
+                assembler.sse(0xDA, 2, width); // pminub xmm2, width
+                assembler.sse(0x74, 2, 1);     // pcmpeqb xmm2, xmm1
+                if (i == 0)
+                    assembler.sse(0x6F, 3, 2); // movdqa xmm3, xmm2
+                else
+                    assembler.sse(0xEB, 3, 2); // por xmm3, xmm2
+            }
+
+            assembler.sse(0xD7, asm_t::rax, 3); // pmovmskb eax, xmm3
+            assembler.byte(0x3D);               // cmp eax, 0xffff
+            assembler.imm32(0xFFFF);
+            auto partial = assembler.label();
+            assembler.jump(asm_t::not_equal, partial);
+            assembler.arith_imm8(0, asm_t::rdi, 16); // add rdi, 16
+            if (accepting)
+                assembler.mov(asm_t::r8, asm_t::rdi);
+            assembler.jump(head);
+
+            assembler.bind(partial);
+            assembler.bytes({ 0xF7, 0xD0 });               // not eax
+            assembler.bytes({ 0x0F, 0xBC, 0xC0 });         // bsf eax, eax
+            assembler.arith(0x01, asm_t::rdi, asm_t::rax); // add rdi, rax
+            if (accepting)
+                assembler.mov(asm_t::r8, asm_t::rdi);
+        }
+
+        /*
+         * const uint8_t* scan(const uint8_t* begin, const uint8_t* end, int* state)
+         *
+         * rdi is the current position, rsi the end of the input, r8 the end of
+         * the longest token so far and r9d the state that accepted it.
+         */
+        std::vector<uint8_t> generate() {
+            using asm_t = x86_assembler;
+            asm_t assembler;
+            const auto& states = _lexer.states();
+
+            std::vector<size_t> labels;
+            for (size_t i = 0; i < states.size(); ++i)
+                labels.push_back(assembler.label());
+            auto done = assembler.label();
+
+            assembler.mov(asm_t::r8, asm_t::rdi);
+            assembler.mov32(asm_t::r9, static_cast<uint32_t>(-1));
+            assembler.jump(labels[_lexer.start()]);
+
+            for (size_t i = 0; i < states.size(); ++i) {
+                auto transitions = ranges(static_cast<int>(i));
+                bool accepting = states[i].terminal;
+
+                assembler.bind(labels[i]);
+                if (accepting) {
+                    assembler.mov(asm_t::r8, asm_t::rdi);
+                    assembler.mov32(asm_t::r9, static_cast<uint32_t>(i));
+                }
+
+                std::vector<byte_range> loop;
+                for (auto&& range : transitions) {
+                    if (range.next == static_cast<int>(i))
+                        loop.push_back(range);
+                }
+
+                auto scalar = assembler.label();
+                if (!loop.empty() && loop.size() <= max_simd_ranges)
+                    self_loop(assembler, loop, accepting, scalar);
+
+                assembler.bind(scalar);
+                assembler.arith(0x39, asm_t::rdi, asm_t::rsi); // cmp rdi, rsi
+                assembler.jump(asm_t::above_equal, done);
+                assembler.bytes({ 0x0F, 0xB6, 0x07 });         // movzx eax, byte [rdi]
+                assembler.bytes({ 0x48, 0xFF, 0xC7 });         // inc rdi
+                dispatch(assembler, transitions, 0, transitions.size(), labels, done);
+            }
+
+            assembler.bind(done);
+            assembler.bytes({ 0x44, 0x89, 0x0A }); // mov [rdx], r9d
+            assembler.mov(asm_t::rax, asm_t::r8);
+            assembler.byte(0xC3); // ret
+
+            return assembler.finish();
+        }
+
+        void compile() {
+            if (sizeof(CharType) != 1)
+                return;
+
+            auto code = generate();
+            auto memory = mmap(
+                nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+            );
+            if (memory == MAP_FAILED)
+                return;
+
+            std::memcpy(memory, code.data(), code.size());
+            if (mprotect(memory, code.size(), PROT_READ | PROT_EXEC) != 0) {
+                munmap(memory, code.size());
+                return;
+            }
+
+            _memory = memory;
+            _size = code.size();
+            _scan = reinterpret_cast<scan_function>(memory);
+        }
+#else
+        void compile() {
+        }
+#endif
+
+      public:
+        explicit jit_lexer(const lexer_type& lexer_)
+          : _lexer(lexer_), _memory(nullptr), _size(0), _scan(nullptr) {
+            compile();
+        }
+
+        /**
+         * Whether native code is used, as opposed to the lexer's tables.
+         */
+        bool compiled() const {
+            return _scan != nullptr;
+        }
+
+        /**
+         * Same as lexer::match() on contiguous input.
+         */
+        size_t match(const CharType* begin, const CharType* end, int& production) const {
+            if (_scan == nullptr)
+                return _lexer.match(begin, end, production);
+
+            int state;
+            auto first = reinterpret_cast<const uint8_t*>(begin);
+            auto length = static_cast<size_t>(
+                _scan(first, reinterpret_cast<const uint8_t*>(end), &state) - first
+            );
+            if (length == 0)
+                return 0;
+            production = _lexer.accept(state, begin, begin + length);
+            return length;
+        }
+
+        /**
+         * Same as lexer::tokenize(). The native code starts in mode 0, the other
+         * modes use the lexer's tables.
+         */
+        size_t tokenize(
+            const CharType* input,
+            size_t size,
+            lexer_cursor& cursor,
+            int* productions,
+            size_t* offsets,
+            size_t* lengths,
+            size_t capacity
+        ) const {
+            if (cursor.mode != 0) {
+                return _lexer.tokenize(
+                    input, size, cursor, productions, offsets, lengths, capacity
+                );
+            }
+
+            size_t count = 0;
+            cursor.failed = false;
+
+            while (count < capacity && cursor.position < size) {
+                int production;
+                auto length = match(input + cursor.position, input + size, production);
+                if (length == 0) {
+                    cursor.failed = true;
+                    break;
+                }
+
+                productions[count] = production;
+                offsets[count] = cursor.position;
+                lengths[count] = length;
+                cursor.position += length;
+                ++count;
+            }
+
+            return count;
+        }
+
+        ~jit_lexer() {
+#if defined(SUPERCOMPLEX_JIT)
+            if (_memory != nullptr)
+                munmap(_memory, _size);
+#endif
+        }
+    };
+} // namespace supercomplex
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "supercomplex.hpp"
+
+namespace supercomplex {
+    /**
+     * Bounded lock-free queue for exactly one producer and one consumer thread.
+     * The capacity is rounded up to a power of two.
+     */
+    template <typename T>
+    class spsc_ring {
+        std::vector<T> _slots;
+        size_t _mask;
+
+        // Written by the consumer and the producer respectively, kept on separate
+        // cache lines so that they do not bounce between cores.
+        alignas(64) std::atomic<size_t> _head;
+        alignas(64) std::atomic<size_t> _tail;
+
+        spsc_ring(const spsc_ring&) = delete;
+        spsc_ring& operator=(const spsc_ring&) = delete;
+
+      public:
+        explicit spsc_ring(size_t capacity) : _head(0), _tail(0) {
+            size_t size = 1;
+            while (size < capacity)
+                size *= 2;
+            _slots.resize(size);
+            _mask = size - 1;
+        }
+
+        bool try_push(const T& value) {
+            auto tail = _tail.load(std::memory_order_relaxed);
+            if (tail - _head.load(std::memory_order_acquire) == _slots.size())
+                return false;
+            _slots[tail & _mask] = value;
+            _tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool try_pop(T& value) {
+            auto head = _head.load(std::memory_order_relaxed);
+            if (head == _tail.load(std::memory_order_acquire))
+                return false;
+            value = _slots[head & _mask];
+            _head.store(head + 1, std::memory_order_release);
+            return true;
+        }
+    };
+
+    /**
+     * Tokens produced by lexer::tokenize() in one call.
+     */
+    struct token_batch {
+        std::vector<int> productions;
+        std::vector<size_t> offsets;
+        std::vector<size_t> lengths;
+        size_t size;
+    };
+
+    /**
+     * Tokenizes the input on a separate thread while the caller consumes the
+     * tokens. Batches are passed through a ring of filled batches and returned
+     * through a ring of free ones, so no allocation or lock is involved once
+     * the pipeline is running; the producer waits when all the batches are in
+     * use by the consumer.
+     *
+     * acquire() returns the next batch, or nullptr at the end of the input or
+     * when it stopped at input that no token matches (see cursor()). Each
+     * batch has to be given back with release() once processed.
+     */
+    template <typename CharType, typename AdditionalInfo>
+    class lexer_pipeline {
+        const lexer<CharType, AdditionalInfo>& _lexer;
+        const CharType* _input;
+        size_t _size;
+
+        std::vector<token_batch> _batches;
+        spsc_ring<token_batch*> _filled;
+        spsc_ring<token_batch*> _free;
+
+        lexer_cursor _cursor;
+        std::exception_ptr _error;
+        std::atomic<bool> _done;
+        std::atomic<bool> _stopped;
+        std::thread _producer;
+
+        lexer_pipeline(const lexer_pipeline&) = delete;
+        lexer_pipeline& operator=(const lexer_pipeline&) = delete;
+
+        void produce() {
+            try {
+                token_batch* batch = nullptr;
+                while (!_stopped.load(std::memory_order_relaxed)) {
+                    if (batch == nullptr && !_free.try_pop(batch)) {
+                        std::this_thread::yield();
+                        continue;
+                    }
+
+                    batch->size = _lexer.tokenize(
+                        _input,
+                        _size,
+                        _cursor,
+                        batch->productions.data(),
+                        batch->offsets.data(),
+                        batch->lengths.data(),
+                        batch->productions.size()
+                    );
+                    if (batch->size == 0)
+                        break;
+
+                    while (!_filled.try_push(batch)) {
+                        if (_stopped.load(std::memory_order_relaxed))
+                            return;
+                        std::this_thread::yield();
+                    }
+                    batch = nullptr;
+                }
+            } catch (...) {
+                _error = std::current_exception();
+            }
+            _done.store(true, std::memory_order_release);
+        }
+
+      public:
+        lexer_pipeline(
+            const lexer<CharType, AdditionalInfo>& lexer_,
+            const CharType* input,
+            size_t size,
+            size_t batch_size = 1024,
+            size_t depth = 8
+        )
+          : _lexer(lexer_),
+            _input(input),
+            _size(size),
+            _batches(depth),
+            _filled(depth),
+            _free(depth),
+            _done(false),
+            _stopped(false) {
+            if (batch_size == 0 || depth == 0)
+                throw std::invalid_argument("Batch size and depth must be positive.");
+
+            for (auto&& batch : _batches) {
+                batch.productions.resize(batch_size);
+                batch.offsets.resize(batch_size);
+                batch.lengths.resize(batch_size);
+                batch.size = 0;
+                _free.try_push(&batch);
+            }
+
+            _producer = std::thread(&lexer_pipeline::produce, this);
+        }
+
+        const token_batch* acquire() {
+            token_batch* batch;
+            for (;;) {
+                if (_filled.try_pop(batch))
+                    return batch;
+                if (_done.load(std::memory_order_acquire)) {
+                    // The producer may have pushed a batch just before finishing.
+                    if (_filled.try_pop(batch))
+                        return batch;
+                    if (_error)
+                        std::rethrow_exception(_error);
+                    return nullptr;
+                }
+                std::this_thread::yield();
+            }
+        }
+
+        void release(const token_batch* batch) {
+            _free.try_push(const_cast<token_batch*>(batch));
+        }
+
+        /**
+         * Where the producer stopped, only valid after acquire() returned
+         * nullptr.
+         */
+        const lexer_cursor& cursor() const {
+            return _cursor;
+        }
+
+        ~lexer_pipeline() {
+            _stopped.store(true, std::memory_order_relaxed);
+            _producer.join();
+        }
+    };
+} // namespace supercomplex